@@ -2,66 +2,358 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <cmath>
 #include <random>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <memory>
 #include <omp.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMPLEPT_X86_SIMD 1
+#define SIMPLEPT_TARGET(isa) __attribute__((target(isa)))
+#endif
 #define PI 3.1415926535897932384626433832795
 
 
 
 /*
-* Thread-safe random number generator
+* Random number generation
+*/
+
+// SplitMix64 finalizer, used to turn structured seeds into well-mixed ones
+inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// PCG32 (O'Neill 2014): 16 bytes of state, padded to a cache line so that
+// generators owned by different threads never share one. Passed explicitly
+// to everything that draws samples.
+struct alignas(64) RNG {
+	RNG(uint64_t seed = 0, uint64_t stream = 0) { init(seed, stream); }
+
+	void init(uint64_t seed, uint64_t stream) {
+		state = 0;
+		inc = (stream << 1) | 1;
+		nextUInt();
+		state += seed;
+		nextUInt();
+	}
+
+	uint32_t nextUInt() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+		uint32_t rot = uint32_t(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	double operator()() { // uniform in [0, 1)
+		return nextUInt() * (1.0 / 4294967296.0);
+	}
+
+	uint64_t state, inc;
+};
+
+// Generator for one pixel sample. Depends only on the pixel, the sample index
+// and the global seed, so renders are reproducible for any thread count.
+inline RNG sampleRNG(uint64_t seed, int pixel, int sample) {
+	return RNG(mix64(seed ^ (uint64_t(sample) << 32 | uint32_t(pixel))), uint64_t(pixel));
+}
+
+
+/*
+* Samplers
+*
+* A Sampler hands out the random numbers of one pixel sample. Callers pick
+* the sample dimension with setDimension() so that the same decision (filter
+* offset, light sample, BRDF sample at bounce k, ...) always reads the same
+* dimension, which is what lets low-discrepancy samplers stratify them.
 */
 
-struct RNG {
-	RNG() : distrb(0.0, 1.0), engines() {}
+enum SamplerType { SAMPLER_INDEPENDENT, SAMPLER_SOBOL, SAMPLER_BLUENOISE };
+
+const char *samplerName(int type) {
+	return type == SAMPLER_SOBOL ? "sobol" : type == SAMPLER_BLUENOISE ? "bluenoise" : "independent";
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Owen scrambling by hashing (Burley 2020, "Practical Hash-based Owen
+// Scrambling"). The Laine-Karras permutation only carries bits upwards, so
+// applying it to the reversed value scrambles each digit based on the
+// digits above it.
+inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+// lowbias32 (Wellons) of a combined with b
+inline uint32_t hashSeed(uint32_t a, uint32_t b) {
+	uint32_t x = a ^ (b * 0x9e3779b9u + 0x7f4a7c15u);
+	x ^= x >> 16; x *= 0x21f0aaadu;
+	x ^= x >> 15; x *= 0x735a2d97u;
+	x ^= x >> 15;
+	return x;
+}
+
+// First two Sobol dimensions, as 0.32 fixed point
+inline uint32_t sobol0(uint32_t i) {
+	return reverseBits(i);
+}
+
+// The generator matrix is linear over GF(2), so it is applied a byte at a time
+struct Sobol1Table {
+	uint32_t t[4][256];
+
+	Sobol1Table() {
+		uint32_t v[32];
+		v[0] = 1u << 31;
+		for (int k = 1; k < 32; ++k) v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+		for (int b = 0; b < 4; ++b)
+			for (int x = 0; x < 256; ++x) {
+				t[b][x] = 0;
+				for (int k = 0; k < 8; ++k) if (x >> k & 1) t[b][x] ^= v[8 * b + k];
+			}
+	}
+};
+
+const Sobol1Table sobol1Table;
+
+inline uint32_t sobol1(uint32_t i) {
+	const uint32_t (*t)[256] = sobol1Table.t;
+	return t[0][i & 255] ^ t[1][i >> 8 & 255] ^ t[2][i >> 16 & 255] ^ t[3][i >> 24];
+}
+
+// 64x64 tileable blue-noise threshold mask built once with void-and-cluster
+// (Ulichney 1993). Values are ranks mapped to [0, 1).
+const int blueNoiseSize = 64;
+
+std::vector<float> buildBlueNoise() {
+	const int n = blueNoiseSize, count = n * n, radius = 6;
+	const double sigma = 1.5;
+
+	double kernel[2 * radius + 1][2 * radius + 1];
+	for (int dy = -radius; dy <= radius; ++dy)
+		for (int dx = -radius; dx <= radius; ++dx)
+			kernel[dy + radius][dx + radius] = std::exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+
+	std::vector<char> on(count, 0);
+	std::vector<double> energy(count, 0.0);
+	std::vector<float> rank(count, 0.0f);
+	auto splat = [&](int p, double sign) {
+		int px = p % n, py = p / n;
+		for (int dy = -radius; dy <= radius; ++dy)
+			for (int dx = -radius; dx <= radius; ++dx)
+				energy[((py + dy + n) % n) * n + (px + dx + n) % n] += sign * kernel[dy + radius][dx + radius];
+	};
+	auto tightestCluster = [&]() {
+		int best = -1;
+		for (int p = 0; p < count; ++p) if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+		return best;
+	};
+	auto largestVoid = [&]() {
+		int best = -1;
+		for (int p = 0; p < count; ++p) if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+		return best;
+	};
+
+	// Initial pattern: 10% random points, relaxed until stable
+	RNG rng(7, 0);
+	int ones = 0;
+	while (ones < count / 10) {
+		int p = int(rng.nextUInt() % count);
+		if (!on[p]) { on[p] = 1; splat(p, 1); ++ones; }
+	}
+	for (int iter = 0; iter < 4 * count; ++iter) {
+		int c = tightestCluster();
+		on[c] = 0; splat(c, -1);
+		int v = largestVoid();
+		on[v] = 1; splat(v, 1);
+		if (v == c) break;
+	}
+
+	// Rank the initial points by removing clusters, then fill the voids
+	std::vector<char> initial = on;
+	std::vector<double> initialEnergy = energy;
+	for (int r = ones - 1; r >= 0; --r) {
+		int c = tightestCluster();
+		on[c] = 0; splat(c, -1);
+		rank[c] = float(r);
+	}
+	on = initial;
+	energy = initialEnergy;
+	for (int r = ones; r < count; ++r) {
+		int v = largestVoid();
+		on[v] = 1; splat(v, 1);
+		rank[v] = float(r);
+	}
+
+	for (int p = 0; p < count; ++p) rank[p] = (rank[p] + 0.5f) / count;
+	return rank;
+}
+
+const std::vector<float> &blueNoiseMask() {
+	static const std::vector<float> mask = buildBlueNoise();
+	return mask;
+}
+
+struct Sampler {
+	Sampler(int type_ = SAMPLER_INDEPENDENT, uint64_t seed_ = 0) :
+		type(type_), seed(seed_), px(0), py(0), index(0), scramble(0), dim(0) {}
+
+	// Begins sample `index_` of pixel (x, y); `pixel` is its linear id
+	void startSample(int x, int y, int pixel, int index_) {
+		px = x; py = y; index = uint32_t(index_); dim = 0;
+		if (type == SAMPLER_INDEPENDENT) rng = sampleRNG(seed, pixel, index_);
+		// blue-noise dithering shares one sequence across all pixels
+		uint32_t s = uint32_t(mix64(seed));
+		scramble = type == SAMPLER_SOBOL ? hashSeed(s, uint32_t(pixel)) : s;
+	}
+
+	void setDimension(int d) { dim = d; }
+
+	double get1D() {
+		if (type == SAMPLER_INDEPENDENT) return rng();
+		double u, v;
+		lowDiscrepancy2D(u, v);
+		dim -= 1;
+		return u;
+	}
 
-	void init(int nworkers) {
-		std::random_device rd;
-		engines.resize(nworkers);
-		for (int i = 0; i < nworkers; ++i)
-			engines[i].seed(rd());
+	void get2D(double &u, double &v) {
+		if (type == SAMPLER_INDEPENDENT) { u = rng(); v = rng(); return; }
+		lowDiscrepancy2D(u, v);
 	}
 
-	double operator()() {
-		int id = omp_get_thread_num();
-		return distrb(engines[id]);
+	int type;
+	uint64_t seed;
+
+private:
+	// Owen-scrambled (0,2)-sequence for this dimension pair. The sample index
+	// is shuffled per pair so that the pairs are decorrelated from each other.
+	void lowDiscrepancy2D(double &u, double &v) {
+		uint32_t s = hashSeed(scramble, uint32_t(dim));
+		uint32_t i = nestedUniformScramble(index, s);
+		u = nestedUniformScramble(sobol0(i), hashSeed(s, 1)) * (1.0 / 4294967296.0);
+		v = nestedUniformScramble(sobol1(i), hashSeed(s, 2)) * (1.0 / 4294967296.0);
+
+		if (type == SAMPLER_BLUENOISE) {
+			// toroidally shifted mask per dimension (Georgiev & Fajardo 2016)
+			const std::vector<float> &mask = blueNoiseMask();
+			const int m = blueNoiseSize - 1;
+			uint32_t h = hashSeed(s, 3);
+			u += mask[((py + (h & m)) & m) * blueNoiseSize + ((px + (h >> 8 & m)) & m)];
+			v += mask[((py + (h >> 16 & m)) & m) * blueNoiseSize + ((px + (h >> 24 & m)) & m)];
+			if (u >= 1) u -= 1;
+			if (v >= 1) v -= 1;
+		}
+		dim += 2;
 	}
 
-	std::uniform_real_distribution<double> distrb;
-	std::vector<std::mt19937> engines;
-} rng;
+	RNG rng;
+	int px, py;
+	uint32_t index, scramble;
+	int dim;
+};
 
 
 /*
 * Basic data types
 */
 
-struct Vec {
-	double x, y, z;
+// Scalar type of vectors and shading math. Build with -DSIMPLEPT_FP32 to
+// run them in single precision; the BVH's SoA leaf tests stay in double,
+// which the 1e5-radius walls need.
+#ifdef SIMPLEPT_FP32
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+template <class T>
+struct TVec {
+	T x, y, z;
 
-	Vec(double x_ = 0, double y_ = 0, double z_ = 0) { x = x_; y = y_; z = z_; }
+	TVec(T x_ = 0, T y_ = 0, T z_ = 0) { x = x_; y = y_; z = z_; }
 
-	Vec operator+ (const Vec &b) const { return Vec(x + b.x, y + b.y, z + b.z); }
-	Vec operator- (const Vec &b) const { return Vec(x - b.x, y - b.y, z - b.z); }
-	Vec operator* (double b) const { return Vec(x*b, y*b, z*b); }
+	TVec operator+ (const TVec &b) const { return TVec(x + b.x, y + b.y, z + b.z); }
+	TVec operator- (const TVec &b) const { return TVec(x - b.x, y - b.y, z - b.z); }
+	TVec operator* (T b) const { return TVec(x*b, y*b, z*b); }
 
-	Vec mult(const Vec &b) const { return Vec(x*b.x, y*b.y, z*b.z); }
-	Vec& normalize() { return *this = *this * (1.0 / std::sqrt(x*x + y*y + z*z)); }
-	double dot(const Vec &b) const { return x*b.x + y*b.y + z*b.z; }
-	Vec cross(const Vec&b) const { return Vec(y*b.z - z*b.y, z*b.x - x*b.z, x*b.y - y*b.x); }
+	TVec mult(const TVec &b) const { return TVec(x*b.x, y*b.y, z*b.z); }
+	TVec& normalize() { return *this = *this * (T(1) / std::sqrt(x*x + y*y + z*z)); }
+	T dot(const TVec &b) const { return x*b.x + y*b.y + z*b.z; }
+	TVec cross(const TVec&b) const { return TVec(y*b.z - z*b.y, z*b.x - x*b.z, x*b.y - y*b.x); }
 };
 
+typedef TVec<Real> Vec;
+
 struct Ray {
 	Vec o, d;
 	Ray(Vec o_, Vec d_) : o(o_), d(d_) {}
 };
 
+// Orthonormal basis around a unit normal n (Duff et al. 2017, "Building an
+// Orthonormal Basis, Revisited"). Built once per hit and shared by every
+// sampling routine at that hit.
+struct Frame {
+	Vec u, v, n;
+
+	Frame() {}
+	explicit Frame(const Vec &n_) : n(n_) {
+		Real sign = std::copysign(1.0, n.z), a = -1.0 / (sign + n.z), b = n.x * n.y * a;
+		u = Vec(1.0 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+		v = Vec(b, sign + n.y * n.y * a, -n.y);
+	}
+
+	Vec toWorld(Real x, Real y, Real z) const { return u * x + v * y + n * z; }
+};
+
+enum BRDFType { BRDF_DIFFUSE, BRDF_SPECULAR };
+
+// Closed set of BRDFs: a type tag plus its reflectance. The member functions
+// switch on the tag into BRDFKernel<type> (see BRDFs below); loops that
+// already know the type call the kernel directly.
 struct BRDF {
-	virtual bool isSpecular() const = 0;
-	virtual Vec eval(const Vec &n, const Vec &o, const Vec &i) const = 0;
-	virtual void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const = 0;
+	BRDF(int type_, const Vec &k_) : type(type_), k(k_) {}
+
+	bool isSpecular() const { return type == BRDF_SPECULAR; }
+	Vec eval(const Frame &f, const Vec &o, const Vec &i) const;
+	void sample(const Frame &f, const Vec &o, Vec &i, Real &pdf, Sampler &sampler) const;
+	Real pdf(const Frame &f, const Vec &o, const Vec &i) const;   // of sample() drawing i
+
+	int type;
+	Vec k;      // diffuse or specular reflectance
 };
 
 
@@ -73,10 +365,67 @@ inline double clamp(double x) {
 	return x < 0 ? 0 : x > 1 ? 1 : x;
 }
 
-inline int toInt(double x) {
+// 8-bit display value of linear x, gamma 2.2
+inline int gammaPow(double x) {
 	return static_cast<int>(std::pow(clamp(x), 1.0 / 2.2) * 255 + .5);
 }
 
+// Table form of gammaPow() with identical results: lut gives the value at the
+// start of each of `bins` equal bins of [0, 1], and threshold[v], the least x
+// mapping to v (found by bisection on gammaPow itself), steps past the few
+// value boundaries inside a bin.
+struct GammaTable {
+	enum { bins = 4096 };
+
+	GammaTable() {
+		for (int v = 1; v < 256; ++v) {
+			double lo = 0, hi = 1;
+			for (int k = 0; k < 80; ++k) {
+				double mid = .5 * (lo + hi);
+				if (gammaPow(mid) >= v) hi = mid;
+				else lo = mid;
+			}
+			threshold[v] = hi;
+		}
+		threshold[0] = 0;
+		threshold[256] = 2;   // sentinel above any clamped input
+		for (int b = 0; b <= bins; ++b) lut[b] = (unsigned char)gammaPow(double(b) / bins);
+	}
+
+	int operator()(double x) const {
+		if (!(x > 0)) return 0;
+		if (x > 1) x = 1;
+		int v = lut[int(x * bins)];
+		while (x >= threshold[v + 1]) ++v;
+		return v;
+	}
+
+	unsigned char lut[bins + 1];
+	double threshold[257];
+};
+
+const GammaTable gammaTable;
+
+inline int toInt(double x) {
+	return gammaTable(x);
+}
+
+inline Vec vmin(const Vec &a, const Vec &b) {
+	return Vec(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+inline Vec vmax(const Vec &a, const Vec &b) {
+	return Vec(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+inline double luminance(const Vec &c) {
+	return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+inline double axis(const Vec &v, int a) {
+	return a == 0 ? v.x : a == 1 ? v.y : v.z;
+}
+
 
 /*
 * Shapes
@@ -96,286 +445,5744 @@ struct Sphere {
 		if (det<0) return 0; else det = sqrt(det);
 		return (t = b - det)>eps ? t : ((t = b + det)>eps ? t : 0);
 	}
+
+	bool occludes(const Ray &r, double tmax) const { // any hit with eps < t < tmax
+		Vec op = p - r.o;
+		double t, eps = 1e-4, b = op.dot(r.d), det = b*b - op.dot(op) + rad*rad;
+		if (det<0) return false; else det = sqrt(det);
+		return ((t = b - det)>eps && t<tmax) || ((t = b + det)>eps && t<tmax);
+	}
 };
 
+// Indexed triangle mesh. Vertex positions are stored one plane per axis and
+// usually point straight into a mapped mesh file, which `storage` keeps alive.
+struct Mesh {
+	const float *x, *y, *z;       // vertex positions
+	const uint32_t *indices;      // three vertex indices per triangle
+	int numVertices, numTriangles;
+	int firstId;                  // primitive id of triangle 0
+	const BRDF *brdf;
+	std::shared_ptr<const void> storage;
 
-/*
-* Sampling functions
-*/
+	Mesh() : x(0), y(0), z(0), indices(0), numVertices(0), numTriangles(0), firstId(0), brdf(0) {}
 
-inline void createLocalCoord(const Vec &n, Vec &u, Vec &v, Vec &w) {
-	w = n;
-	u = ((std::abs(w.x)>.1 ? Vec(0, 1) : Vec(1)).cross(w)).normalize();
-	v = w.cross(u);
-}
+	Vec vertex(uint32_t v) const { return Vec(x[v], y[v], z[v]); }
 
-void uniformRandomPSA(const Vec &n, const Vec &o, Vec &i, double &pdf) {
-	double z = sqrt(rng());
-	double r = sqrt(1.0 - z * z);
-	double phi = 2.0 * PI * rng();
-	double x = r * cos(phi);
-	double y = r * sin(phi);
+	Vec normal(int tri) const {
+		const uint32_t *v = indices + 3 * tri;
+		Vec a = vertex(v[0]);
+		return (vertex(v[1]) - a).cross(vertex(v[2]) - a).normalize();
+	}
+};
 
-	Vec u, v, w;
-	createLocalCoord(n, u, v, w);
-	i = (u * x) + (v * y) + (w * z);
-	i.normalize();
-	pdf = n.dot(i) / PI;
+// Möller-Trumbore test of r against triangle tri of m, in double precision
+// whatever Real is; same contract as Sphere::intersect
+inline double hitTriangle(const Mesh &m, int tri, const Ray &r) {
+	const double eps = 1e-4;
+	const uint32_t *v = m.indices + 3 * tri;
+	double ax = m.x[v[0]], ay = m.y[v[0]], az = m.z[v[0]];
+	double e1x = m.x[v[1]] - ax, e1y = m.y[v[1]] - ay, e1z = m.z[v[1]] - az;
+	double e2x = m.x[v[2]] - ax, e2y = m.y[v[2]] - ay, e2z = m.z[v[2]] - az;
+	double px = r.d.y*e2z - r.d.z*e2y, py = r.d.z*e2x - r.d.x*e2z, pz = r.d.x*e2y - r.d.y*e2x;
+	double det = e1x*px + e1y*py + e1z*pz;
+	if (det == 0) return 0;
+	double inv = 1.0 / det;
+	double sx = r.o.x - ax, sy = r.o.y - ay, sz = r.o.z - az;
+	double u = (sx*px + sy*py + sz*pz) * inv;
+	if (u < 0 || u > 1) return 0;
+	double qx = sy*e1z - sz*e1y, qy = sz*e1x - sx*e1z, qz = sx*e1y - sy*e1x;
+	double w = (r.d.x*qx + r.d.y*qy + r.d.z*qz) * inv;
+	if (w < 0 || u + w > 1) return 0;
+	double t = (e2x*qx + e2y*qy + e2z*qz) * inv;
+	return t > eps ? t : 0;
 }
 
 /*
-* BRDFs
+* Structure-of-arrays sphere layout and SIMD intersection kernels
 */
 
-// Ideal diffuse BRDF
-struct DiffuseBRDF : public BRDF {
-	DiffuseBRDF(Vec kd_) : kd(kd_) {}
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
 
-	bool isSpecular() const {
-		return false;
+const char *simdLevelName(int level) {
+	return level == SIMD_AVX512 ? "avx512" : level == SIMD_AVX2 ? "avx2" : "scalar";
+}
+
+// Widest kernel this build and this CPU can run
+int bestSimdLevel() {
+#ifdef SIMPLEPT_X86_SIMD
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+#endif
+	return SIMD_SCALAR;
+}
+
+// Hot intersection data only (no emission or BRDF). Arrays carry `pad` extra
+// entries that can never be hit so vector loads may run past the last sphere.
+struct SphereSoA {
+	static const int pad = 8;
+	std::vector<double> cx, cy, cz, r2;
+	std::vector<int> ids;      // index into the source sphere array
+
+	void assign(const Sphere *s, const int *order, int n) {
+		cx.assign(n + pad, 0.0); cy.assign(n + pad, 0.0); cz.assign(n + pad, 0.0);
+		r2.assign(n + pad, -1.0);  // b^2 - |op|^2 <= 0, so det < 0 for padding
+		ids.assign(n + pad, -1);
+		for (int i = 0; i < n; ++i) {
+			const Sphere &sp = s[order ? order[i] : i];
+			cx[i] = sp.p.x; cy[i] = sp.p.y; cz[i] = sp.p.z;
+			r2[i] = sp.rad * sp.rad;
+			ids[i] = order ? order[i] : i;
+		}
 	}
 
-	Vec eval(const Vec &n, const Vec &o, const Vec &i) const {
-		return kd * (1.0 / PI);
+	int size() const { return int(ids.size()) - pad; }
+};
+
+// Each kernel tests r against spheres [begin, begin + count) with the same
+// arithmetic as Sphere::intersect / Sphere::occludes. hitSpheres* lowers t
+// and sets id if a closer hit exists; occludeSpheres* reports any hit in
+// (eps, tmax).
+
+inline bool hitSpheresScalar(const SphereSoA &s, int begin, int count, const Ray &r, double &t, int &id) {
+	const double eps = 1e-4;
+	bool hit = false;
+	for (int i = begin, e = begin + count; i < e; ++i) {
+		double px = s.cx[i] - r.o.x, py = s.cy[i] - r.o.y, pz = s.cz[i] - r.o.z;
+		double b = px*r.d.x + py*r.d.y + pz*r.d.z, det = b*b - (px*px + py*py + pz*pz) + s.r2[i];
+		if (det < 0) continue;
+		det = std::sqrt(det);
+		double d = b - det > eps ? b - det : b + det > eps ? b + det : 0;
+		if (d && d < t) { t = d; id = s.ids[i]; hit = true; }
 	}
+	return hit;
+}
 
-	void sample(const Vec &n, const Vec &o, Vec &i, double &pdf) const {
-		uniformRandomPSA(n, o, i, pdf);
+inline bool occludeSpheresScalar(const SphereSoA &s, int begin, int count, const Ray &r, double tmax) {
+	const double eps = 1e-4;
+	for (int i = begin, e = begin + count; i < e; ++i) {
+		double px = s.cx[i] - r.o.x, py = s.cy[i] - r.o.y, pz = s.cz[i] - r.o.z;
+		double b = px*r.d.x + py*r.d.y + pz*r.d.z, det = b*b - (px*px + py*py + pz*pz) + s.r2[i];
+		if (det < 0) continue;
+		det = std::sqrt(det);
+		double t0 = b - det, t1 = b + det;
+		if ((t0 > eps && t0 < tmax) || (t1 > eps && t1 < tmax)) return true;
 	}
+	return false;
+}
 
-	Vec kd;
-};
+#ifdef SIMPLEPT_X86_SIMD
 
-struct SpecularBRDF : public BRDF {
-	SpecularBRDF(Vec ks_) : ks(ks_) {}
+// 4 spheres per instruction. Lanes past `count` are masked off.
+SIMPLEPT_TARGET("avx2")
+bool hitSpheresAVX2(const SphereSoA &s, int begin, int count, const Ray &r, double &t, int &id) {
+	const __m256d ox = _mm256_set1_pd(r.o.x), oy = _mm256_set1_pd(r.o.y), oz = _mm256_set1_pd(r.o.z);
+	const __m256d dx = _mm256_set1_pd(r.d.x), dy = _mm256_set1_pd(r.d.y), dz = _mm256_set1_pd(r.d.z);
+	const __m256d eps = _mm256_set1_pd(1e-4), zero = _mm256_setzero_pd(), inf = _mm256_set1_pd(1e300);
+	const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	const __m256d end = _mm256_set1_pd(double(count));
 
-	bool isSpecular() const {
-		return true;
+	__m256d best = _mm256_set1_pd(t), bestIdx = _mm256_set1_pd(-1);
+	for (int i = 0; i < count; i += 4) {
+		const int k = begin + i;
+		__m256d px = _mm256_sub_pd(_mm256_loadu_pd(&s.cx[k]), ox);
+		__m256d py = _mm256_sub_pd(_mm256_loadu_pd(&s.cy[k]), oy);
+		__m256d pz = _mm256_sub_pd(_mm256_loadu_pd(&s.cz[k]), oz);
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, dx), _mm256_mul_pd(py, dy)), _mm256_mul_pd(pz, dz));
+		__m256d pp = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, px), _mm256_mul_pd(py, py)), _mm256_mul_pd(pz, pz));
+		__m256d det = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b, b), pp), _mm256_loadu_pd(&s.r2[k]));
+		__m256d idx = _mm256_add_pd(lane, _mm256_set1_pd(double(i)));
+		__m256d valid = _mm256_and_pd(_mm256_cmp_pd(det, zero, _CMP_GE_OQ), _mm256_cmp_pd(idx, end, _CMP_LT_OQ));
+		if (!_mm256_movemask_pd(valid)) continue;
+
+		__m256d sq = _mm256_sqrt_pd(_mm256_max_pd(det, zero));
+		__m256d t0 = _mm256_sub_pd(b, sq), t1 = _mm256_add_pd(b, sq);
+		__m256d d = _mm256_blendv_pd(inf, t1, _mm256_cmp_pd(t1, eps, _CMP_GT_OQ));
+		d = _mm256_blendv_pd(d, t0, _mm256_cmp_pd(t0, eps, _CMP_GT_OQ));
+
+		__m256d closer = _mm256_and_pd(valid, _mm256_cmp_pd(d, best, _CMP_LT_OQ));
+		best = _mm256_blendv_pd(best, d, closer);
+		bestIdx = _mm256_blendv_pd(bestIdx, idx, closer);
 	}
 
-	void mirroredDirection(const Vec &n, const Vec &o, Vec &i) const {
-		i = n * 2.0 * n.dot(o) - o;
+	double bt[4], bi[4];
+	_mm256_storeu_pd(bt, best);
+	_mm256_storeu_pd(bi, bestIdx);
+	int lo = -1;
+	for (int l = 0; l < 4; ++l)
+		if (bi[l] >= 0 && bt[l] < t) { t = bt[l]; lo = int(bi[l]); }
+	if (lo < 0) return false;
+	id = s.ids[begin + lo];
+	return true;
+}
+
+SIMPLEPT_TARGET("avx2")
+bool occludeSpheresAVX2(const SphereSoA &s, int begin, int count, const Ray &r, double tmax) {
+	const __m256d ox = _mm256_set1_pd(r.o.x), oy = _mm256_set1_pd(r.o.y), oz = _mm256_set1_pd(r.o.z);
+	const __m256d dx = _mm256_set1_pd(r.d.x), dy = _mm256_set1_pd(r.d.y), dz = _mm256_set1_pd(r.d.z);
+	const __m256d eps = _mm256_set1_pd(1e-4), zero = _mm256_setzero_pd(), tm = _mm256_set1_pd(tmax);
+	const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+	const __m256d end = _mm256_set1_pd(double(count));
+
+	for (int i = 0; i < count; i += 4) {
+		const int k = begin + i;
+		__m256d px = _mm256_sub_pd(_mm256_loadu_pd(&s.cx[k]), ox);
+		__m256d py = _mm256_sub_pd(_mm256_loadu_pd(&s.cy[k]), oy);
+		__m256d pz = _mm256_sub_pd(_mm256_loadu_pd(&s.cz[k]), oz);
+		__m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, dx), _mm256_mul_pd(py, dy)), _mm256_mul_pd(pz, dz));
+		__m256d pp = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, px), _mm256_mul_pd(py, py)), _mm256_mul_pd(pz, pz));
+		__m256d det = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b, b), pp), _mm256_loadu_pd(&s.r2[k]));
+		__m256d idx = _mm256_add_pd(lane, _mm256_set1_pd(double(i)));
+		__m256d valid = _mm256_and_pd(_mm256_cmp_pd(det, zero, _CMP_GE_OQ), _mm256_cmp_pd(idx, end, _CMP_LT_OQ));
+		if (!_mm256_movemask_pd(valid)) continue;
+
+		__m256d sq = _mm256_sqrt_pd(_mm256_max_pd(det, zero));
+		__m256d t0 = _mm256_sub_pd(b, sq), t1 = _mm256_add_pd(b, sq);
+		__m256d in0 = _mm256_and_pd(_mm256_cmp_pd(t0, eps, _CMP_GT_OQ), _mm256_cmp_pd(t0, tm, _CMP_LT_OQ));
+		__m256d in1 = _mm256_and_pd(_mm256_cmp_pd(t1, eps, _CMP_GT_OQ), _mm256_cmp_pd(t1, tm, _CMP_LT_OQ));
+		if (_mm256_movemask_pd(_mm256_and_pd(valid, _mm256_or_pd(in0, in1)))) return true;
 	}
+	return false;
+}
 
-	Vec eval(const Vec&n, const Vec &o, const Vec &i) const {
-		Vec mirrored;
-		mirroredDirection(n, o, mirrored);
-		Vec i_n = i;
-		mirrored.normalize();
-		i_n.normalize();
+// 8 spheres per instruction, so a whole BVH leaf is a single iteration
+SIMPLEPT_TARGET("avx512f")
+bool hitSpheresAVX512(const SphereSoA &s, int begin, int count, const Ray &r, double &t, int &id) {
+	const __m512d ox = _mm512_set1_pd(r.o.x), oy = _mm512_set1_pd(r.o.y), oz = _mm512_set1_pd(r.o.z);
+	const __m512d dx = _mm512_set1_pd(r.d.x), dy = _mm512_set1_pd(r.d.y), dz = _mm512_set1_pd(r.d.z);
+	const __m512d eps = _mm512_set1_pd(1e-4), zero = _mm512_setzero_pd(), inf = _mm512_set1_pd(1e300);
 
-		if (abs(i_n.x - mirrored.x) <= 1e-4 &&
-			abs(i_n.y - mirrored.y) <= 1e-4 &&
-			abs(i_n.z - mirrored.z) <= 1e-4)
-			return ks * (1 / n.dot(i));
+	double tBest = t;
+	int lo = -1;
+	for (int i = 0; i < count; i += 8) {
+		const int k = begin + i;
+		const __mmask8 live = (__mmask8)(count - i >= 8 ? 0xff : (1u << (count - i)) - 1);
+		__m512d px = _mm512_sub_pd(_mm512_loadu_pd(&s.cx[k]), ox);
+		__m512d py = _mm512_sub_pd(_mm512_loadu_pd(&s.cy[k]), oy);
+		__m512d pz = _mm512_sub_pd(_mm512_loadu_pd(&s.cz[k]), oz);
+		__m512d b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, dx), _mm512_mul_pd(py, dy)), _mm512_mul_pd(pz, dz));
+		__m512d pp = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, px), _mm512_mul_pd(py, py)), _mm512_mul_pd(pz, pz));
+		__m512d det = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(b, b), pp), _mm512_loadu_pd(&s.r2[k]));
+		__mmask8 valid = _mm512_mask_cmp_pd_mask(live, det, zero, _CMP_GE_OQ);
+		if (!valid) continue;
 
-		return Vec();
+		__m512d sq = _mm512_sqrt_pd(_mm512_max_pd(det, zero));
+		__m512d t0 = _mm512_sub_pd(b, sq), t1 = _mm512_add_pd(b, sq);
+		__m512d d = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t1, eps, _CMP_GT_OQ), inf, t1);
+		d = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t0, eps, _CMP_GT_OQ), d, t0);
+
+		__mmask8 closer = _mm512_mask_cmp_pd_mask(valid, d, _mm512_set1_pd(tBest), _CMP_LT_OQ);
+		if (!closer) continue;
+		double dm = _mm512_mask_reduce_min_pd(closer, d);
+		int l = __builtin_ctz(_mm512_mask_cmp_pd_mask(closer, d, _mm512_set1_pd(dm), _CMP_EQ_OQ));
+		tBest = dm;
+		lo = i + l;
 	}
+	if (lo < 0) return false;
+	t = tBest;
+	id = s.ids[begin + lo];
+	return true;
+}
 
-	void sample(const Vec &n, const Vec&o, Vec&i, double &pdf) const {
-		mirroredDirection(n, o, i);
-		pdf = 1.0;
+SIMPLEPT_TARGET("avx512f")
+bool occludeSpheresAVX512(const SphereSoA &s, int begin, int count, const Ray &r, double tmax) {
+	const __m512d ox = _mm512_set1_pd(r.o.x), oy = _mm512_set1_pd(r.o.y), oz = _mm512_set1_pd(r.o.z);
+	const __m512d dx = _mm512_set1_pd(r.d.x), dy = _mm512_set1_pd(r.d.y), dz = _mm512_set1_pd(r.d.z);
+	const __m512d eps = _mm512_set1_pd(1e-4), zero = _mm512_setzero_pd(), tm = _mm512_set1_pd(tmax);
+
+	for (int i = 0; i < count; i += 8) {
+		const int k = begin + i;
+		const __mmask8 live = (__mmask8)(count - i >= 8 ? 0xff : (1u << (count - i)) - 1);
+		__m512d px = _mm512_sub_pd(_mm512_loadu_pd(&s.cx[k]), ox);
+		__m512d py = _mm512_sub_pd(_mm512_loadu_pd(&s.cy[k]), oy);
+		__m512d pz = _mm512_sub_pd(_mm512_loadu_pd(&s.cz[k]), oz);
+		__m512d b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, dx), _mm512_mul_pd(py, dy)), _mm512_mul_pd(pz, dz));
+		__m512d pp = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, px), _mm512_mul_pd(py, py)), _mm512_mul_pd(pz, pz));
+		__m512d det = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(b, b), pp), _mm512_loadu_pd(&s.r2[k]));
+		__mmask8 valid = _mm512_mask_cmp_pd_mask(live, det, zero, _CMP_GE_OQ);
+		if (!valid) continue;
+
+		__m512d sq = _mm512_sqrt_pd(_mm512_max_pd(det, zero));
+		__m512d t0 = _mm512_sub_pd(b, sq), t1 = _mm512_add_pd(b, sq);
+		__mmask8 in0 = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(valid, t0, eps, _CMP_GT_OQ), t0, tm, _CMP_LT_OQ);
+		__mmask8 in1 = _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(valid, t1, eps, _CMP_GT_OQ), t1, tm, _CMP_LT_OQ);
+		if (in0 | in1) return true;
 	}
+	return false;
+}
+
+#endif
+
+inline bool hitSpheres(int level, const SphereSoA &s, int begin, int count, const Ray &r, double &t, int &id) {
+#ifdef SIMPLEPT_X86_SIMD
+	if (level == SIMD_AVX512) return hitSpheresAVX512(s, begin, count, r, t, id);
+	if (level == SIMD_AVX2) return hitSpheresAVX2(s, begin, count, r, t, id);
+#endif
+	return hitSpheresScalar(s, begin, count, r, t, id);
+}
+
+inline bool occludeSpheres(int level, const SphereSoA &s, int begin, int count, const Ray &r, double tmax) {
+#ifdef SIMPLEPT_X86_SIMD
+	if (level == SIMD_AVX512) return occludeSpheresAVX512(s, begin, count, r, tmax);
+	if (level == SIMD_AVX2) return occludeSpheresAVX2(s, begin, count, r, tmax);
+#endif
+	return occludeSpheresScalar(s, begin, count, r, tmax);
+}
 
-	Vec ks;
-};
 
 
 /*
-* Scene configuration
+* Bounding volume hierarchy
 */
 
-// Pre-defined BRDFs
-const DiffuseBRDF leftWall(Vec(.75, .25, .25)),
-rightWall(Vec(.25, .25, .75)),
-otherWall(Vec(.75, .75, .75)),
-blackSurf(Vec(0.0, 0.0, 0.0)),
-brightSurf(Vec(0.9, 0.9, 0.9));
+struct AABB {
+	Vec lo, hi;
 
-const SpecularBRDF shinySurf(Vec(0.999, 0.999, 0.999));
+	AABB() : lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30) {}
+	AABB(const Vec &lo_, const Vec &hi_) : lo(lo_), hi(hi_) {}
 
-// Scene: list of spheres
-const Sphere spheres[] = {
-	Sphere(1e5,  Vec(1e5 + 1,40.8,81.6),   Vec(),         leftWall),   // Left
-	Sphere(1e5,  Vec(-1e5 + 99,40.8,81.6), Vec(),         rightWall),  // Right
-	Sphere(1e5,  Vec(50,40.8, 1e5),      Vec(),         otherWall),  // Back
-	Sphere(1e5,  Vec(50, 1e5, 81.6),     Vec(),         otherWall),  // Bottom
-	Sphere(1e5,  Vec(50,-1e5 + 81.6,81.6), Vec(),         otherWall),  // Top
-	Sphere(16.5, Vec(27,16.5,47),        Vec(),         brightSurf), // Ball 1
-	Sphere(16.5, Vec(73,16.5,78),        Vec(),         shinySurf), // Ball 2
-	Sphere(5.0,  Vec(50,70.0,81.6),      Vec(50,50,50), blackSurf)   // Light
-};
+	void expand(const AABB &b) { lo = vmin(lo, b.lo); hi = vmax(hi, b.hi); }
+	void expand(const Vec &p) { lo = vmin(lo, p); hi = vmax(hi, p); }
+	Vec center() const { return (lo + hi) * 0.5; }
 
-// Camera position & direction
-const Ray cam(Vec(50, 52, 295.6), Vec(0, -0.042612, -1).normalize());
+	double area() const {
+		Vec d = hi - lo;
+		if (d.x < 0) return 0;
+		return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+	}
 
+	int maxAxis() const {
+		Vec d = hi - lo;
+		return d.x > d.y && d.x > d.z ? 0 : d.y > d.z ? 1 : 2;
+	}
+};
 
-/*
-* Global functions
-*/
+inline AABB sphereBounds(const Sphere &s) {
+	Vec r(s.rad, s.rad, s.rad);
+	return AABB(s.p - r, s.p + r);
+}
 
-bool intersect(const Ray &r, double &t, int &id) {
-	double n = sizeof(spheres) / sizeof(Sphere), d, inf = t = 1e20;
-	for (int i = int(n); i--;) if ((d = spheres[i].intersect(r)) && d<t) { t = d; id = i; }
-	return t<inf;
+inline AABB triangleBounds(const Mesh &m, int tri) {
+	const uint32_t *v = m.indices + 3 * tri;
+	AABB b;
+	for (int k = 0; k < 3; ++k) b.expand(m.vertex(v[k]));
+	return b;
 }
 
-void luminaireSample(const Sphere &source, Vec &surfacePoint, Vec &n, double &pdf) {
-	double r = source.rad,
-		e1 = rng(), e2 = rng(),
-		z = 2.0 * e1 - 1.0,
-		x = sqrt(1.0 - (z * z)) * cos(2.0 * PI * e2),
-		y = sqrt(1.0 - (z * z)) * sin(2.0 * PI * e2);
+// A triangle as referenced from a BVH leaf
+struct TriRef {
+	int32_t mesh, tri;
+};
 
-	surfacePoint = source.p + (Vec(x, y, z) * r);
-	n = Vec(x, y, z);
-	pdf = 1 / (4.0 * PI * (r * r));
+// Leaf tests of r against tris [begin, begin + count) of meshes, with the
+// contract of hitSpheres / occludeSpheres
+inline bool hitTriangles(const Mesh *meshes, const TriRef *tris, int begin, int count, const Ray &r, double &t, int &id) {
+	bool hit = false;
+	for (int i = begin, e = begin + count; i < e; ++i) {
+		const Mesh &m = meshes[tris[i].mesh];
+		double d = hitTriangle(m, tris[i].tri, r);
+		if (d && d < t) { t = d; id = m.firstId + tris[i].tri; hit = true; }
+	}
+	return hit;
 }
 
+inline bool occludeTriangles(const Mesh *meshes, const TriRef *tris, int begin, int count, const Ray &r, double tmax) {
+	for (int i = begin, e = begin + count; i < e; ++i) {
+		double d = hitTriangle(meshes[tris[i].mesh], tris[i].tri, r);
+		if (d && d < tmax) return true;
+	}
+	return false;
+}
 
-double isVisibile(const Vec& x, const Vec&y) {
+// Flattened node, stored in depth-first order: the first child of an interior
+// node immediately follows it, the second child lives at `offset`. Leaves
+// hold `count` spheres, consecutive in BVH::soa from `offset`, and
+// `triCount` triangles, consecutive in BVH::tris from `triOffset`.
+struct BVHNode {
+	double lo[3], hi[3];
+	int offset;
+	unsigned short count;   // 0 for interior nodes
+	unsigned short axis;    // split axis of interior nodes
+	int triOffset;
+	int triCount;           // 0 for interior nodes
+
+	bool leaf() const { return count || triCount; }
+};
 
-	Ray r(x, (y - x).normalize());
+struct BVH {
+	static const int maxLeafSize = 8;
+	static const int numBins = 16;
+	static const int stackSize = 64;   // traversal stack, so at most this many interior levels
 
-	double t;
-	int id = 0;
+	std::vector<int> prims;      // sphere ids, in leaf order
+	std::vector<BVHNode> nodes;
+	SphereSoA soa;               // sphere geometry in leaf order
+	std::vector<TriRef> tris;    // triangles in leaf order
+	const Mesh *meshes;          // what tris refer to
+	int simd;                    // SimdLevel used for leaf tests
 
-	intersect(r, t, id);
-	//intersection point
-	Vec ip = r.o + r.d * t;
+	BVH() : meshes(0), simd(SIMD_SCALAR) {}
 
-	//if the intersection point is the same point as y, return 1, else 0
-	if (abs(ip.x - y.x) <= 1e-4 &&
-		abs(ip.y - y.y) <= 1e-4 &&
-		abs(ip.z - y.z) <= 1e-4)
-		return 1.0;
-	return 0.0;
-}
-/*
-* KEY FUNCTION: radiance estimator
-*/
+	// Interior levels traversal of nodes needs, at most stackSize for a
+	// tree it can walk. Children must come after their parent.
+	static int depth(const BVHNode *nodes, int numNodes) {
+		std::vector<int> d(numNodes, 0);   // interior ancestors
+		int deepest = 0;
+		for (int k = 0; k < numNodes; ++k) {
+			if (nodes[k].leaf()) continue;
+			deepest = std::max(deepest, d[k] + 1);
+			d[k + 1] = std::max(d[k + 1], d[k] + 1);
+			d[nodes[k].offset] = std::max(d[nodes[k].offset], d[k] + 1);
+		}
+		return deepest;
+	}
 
-Vec directRadiance(const Sphere &obj, Ray &r, Vec &n) {
-	Vec directRad;
-	if (!obj.brdf.isSpecular()) {
-		Vec y1;				//surface point on light source
-		Vec sourceNormal;	//normal at surface point
-		double pdf1;		//pdf of light source
+	// Builds over n spheres and every triangle of the meshes; both kinds of
+	// primitive may share a leaf
+	void build(const Sphere *spheres, int n, const Mesh *meshes_ = 0, int numMeshes = 0) {
+		simd = bestSimdLevel();
+		meshes = meshes_;
+		prims.clear();
+		tris.clear();
+		nodes.clear();
 
-		//light source hard coded in this example to be 7th sphere in scene
-		//if more light sources present take them as parameters and loop 
-		//over them to get individual contributions?
+		// Build-time primitive k is sphere k for k < n, then triangle all[k - n]
+		std::vector<TriRef> all;
+		for (int m = 0; m < numMeshes; ++m)
+			for (int k = 0; k < meshes[m].numTriangles; ++k) {
+				TriRef ref = { m, k };
+				all.push_back(ref);
+			}
+		const int total = n + int(all.size());
+		soa.assign(spheres, 0, 0);
+		if (total == 0) return;
 
-		luminaireSample(spheres[7], y1, sourceNormal, pdf1);
-		Vec o1 = (y1 - r.o).normalize();
-		double r2 = (r.o - y1).dot(r.o - y1);
+		std::vector<int> order(total);
+		std::vector<AABB> bounds(total);
+		std::vector<Vec> centers(total);
+		for (int i = 0; i < total; ++i) {
+			order[i] = i;
+			bounds[i] = i < n ? sphereBounds(spheres[i]) : triangleBounds(meshes[all[i - n].mesh], all[i - n].tri);
+			centers[i] = bounds[i].center();
+		}
+		nodes.reserve(2 * total);
+		prims.swap(order);
+		buildNode(bounds, centers, 0, total, 0);
+		order.swap(prims);
 
-		directRad = spheres[7].e.mult(obj.brdf.eval(n, o1, r.d)) * isVisibile(r.o, y1)
-			* (n.dot(o1) * sourceNormal.dot(o1 * -1) / (r2 * pdf1));
+		// Leaves are in depth-first order, so appending each leaf's spheres
+		// and triangles keeps both arrays in leaf order
+		for (size_t k = 0; k < nodes.size(); ++k) {
+			BVHNode &node = nodes[k];
+			if (!node.leaf()) continue;
+			const int begin = node.offset, end = begin + node.count;
+			node.offset = int(prims.size());
+			node.triOffset = int(tris.size());
+			for (int i = begin; i < end; ++i) {
+				if (order[i] < n) prims.push_back(order[i]);
+				else tris.push_back(all[order[i] - n]);
+			}
+			node.count = (unsigned short)(prims.size() - node.offset);
+			node.triCount = int(tris.size()) - node.triOffset;
+		}
+		soa.assign(spheres, prims.empty() ? 0 : &prims[0], int(prims.size()));
 	}
 
-	return directRad;
-}
-
-Vec receivedRadiance(const Ray &r, int depth, bool flag) {
-	double t;                                   // Distance to intersection
-	int id = 0;                                 // id of intersected sphere
+	// Closest hit along r, same contract as Sphere::intersect (t > eps)
+	bool intersect(const Ray &r, double &t, int &id) const {
+		const double inf = 1e20;
+		double tHit = inf;
+		int idHit = -1;
+		t = inf;
+		if (nodes.empty()) return false;
 
-	if (!intersect(r, t, id)) return Vec();   // if miss, return black
-	const Sphere &obj = spheres[id];            // the hit object
+		const BVHNode *nd = &nodes[0];
+		double o[3] = { r.o.x, r.o.y, r.o.z };
+		double inv[3] = { 1.0 / r.d.x, 1.0 / r.d.y, 1.0 / r.d.z };
+		int neg[3] = { inv[0] < 0, inv[1] < 0, inv[2] < 0 };
 
-	Vec x = r.o + r.d*t;                        // The intersection point
-	Vec o = (Vec() - r.d).normalize();          // The outgoing direction (= -r.d)
+		int stack[BVH::stackSize], sp = 0, cur = 0;
+		for (;;) {
+			const BVHNode &node = nd[cur];
+			if (hitBox(node, o, inv, tHit)) {
+				if (node.leaf()) {
+					if (node.count) hitSpheres(simd, soa, node.offset, node.count, r, tHit, idHit);
+					if (node.triCount) hitTriangles(meshes, &tris[0], node.triOffset, node.triCount, r, tHit, idHit);
+					if (!sp) break;
+					cur = stack[--sp];
+				}
+				else if (neg[node.axis]) {
+					stack[sp++] = cur + 1;
+					cur = node.offset;
+				}
+				else {
+					stack[sp++] = node.offset;
+					cur = cur + 1;
+				}
+			}
+			else {
+				if (!sp) break;
+				cur = stack[--sp];
+			}
+		}
+		if (idHit < 0) return false;
+		t = tHit;
+		id = idHit;
+		return true;
+	}
 
-	Vec n = (x - obj.p).normalize();            // The normal direction
-	if (n.dot(o) < 0) n = n*-1.0;
+	// Any hit with eps < t < tmax; stops at the first one found
+	bool occluded(const Ray &r, double tmax) const {
+		if (nodes.empty()) return false;
 
-	/*
-	Tips
+		const BVHNode *nd = &nodes[0];
+		double o[3] = { r.o.x, r.o.y, r.o.z };
+		double inv[3] = { 1.0 / r.d.x, 1.0 / r.d.y, 1.0 / r.d.z };
 
-	1. Other useful quantities/variables:
-	Vec Le = obj.e;                             // Emitted radiance
-	const BRDF &brdf = obj.brdf;                // Surface BRDF at x
+		int stack[BVH::stackSize], sp = 0, cur = 0;
+		for (;;) {
+			const BVHNode &node = nd[cur];
+			if (hitBox(node, o, inv, tmax)) {
+				if (node.leaf()) {
+					if (node.count && occludeSpheres(simd, soa, node.offset, node.count, r, tmax)) return true;
+					if (node.triCount && occludeTriangles(meshes, &tris[0], node.triOffset, node.triCount, r, tmax))
+						return true;
+					if (!sp) break;
+					cur = stack[--sp];
+				}
+				else {
+					stack[sp++] = node.offset;
+					cur = cur + 1;
+				}
+			}
+			else {
+				if (!sp) break;
+				cur = stack[--sp];
+			}
+		}
+		return false;
+	}
 
-	2. Call brdf.sample() to sample an incoming direction and continue the recursion
-	*/
+private:
+	static bool hitBox(const BVHNode &b, const double o[3], const double inv[3], double tmax) {
+		double t0 = 0, t1 = tmax;
+		for (int a = 0; a < 3; ++a) {
+			double tn = (b.lo[a] - o[a]) * inv[a];
+			double tf = (b.hi[a] - o[a]) * inv[a];
+			t0 = std::max(t0, std::min(tn, tf));
+			t1 = std::min(t1, std::max(tn, tf));
+		}
+		return t0 <= t1;
+	}
 
-	Vec totalRad; //the sum of direct radiance (if we use it) and the indirect radiance 
-	if (!obj.brdf.isSpecular()) {
-		Ray out(x, o);
-		totalRad = directRadiance(obj, out, n);
+	int makeNode(const AABB &b) {
+		BVHNode node;
+		node.lo[0] = b.lo.x; node.lo[1] = b.lo.y; node.lo[2] = b.lo.z;
+		node.hi[0] = b.hi.x; node.hi[1] = b.hi.y; node.hi[2] = b.hi.z;
+		node.offset = 0; node.count = 0; node.axis = 0;
+		node.triOffset = 0; node.triCount = 0;
+		nodes.push_back(node);
+		return int(nodes.size()) - 1;
 	}
 
-	double p = 1.0;
-	if (depth >= 5)
-		p = 0.9;
+	// Levels of count splits that bring n primitives down to leaves
+	static int medianLevels(int n) {
+		int levels = 0;
+		for (int64_t leaves = maxLeafSize; leaves < n; leaves *= 2) ++levels;
+		return levels;
+	}
 
-	if (rng() < p) {
+	// Binned SAH build over prims[begin, end), at `level` interior nodes below
+	// the root. Near the traversal stack's limit it splits at the median
+	// instead, which is sure to reach leaves within the stack.
+	int buildNode(const std::vector<AABB> &bounds, const std::vector<Vec> &centers, int begin, int end, int level) {
+		AABB box, cbox;
+		for (int i = begin; i < end; ++i) {
+			box.expand(bounds[prims[i]]);
+			cbox.expand(centers[prims[i]]);
+		}
+		int id = makeNode(box), n = end - begin;
 
-		//sample a new incoming direction at the surface point
-		Vec i;
-		double pdf;
-		obj.brdf.sample(n, o, i, pdf);
+		int ax = cbox.maxAxis();
+		double cmin = axis(cbox.lo, ax), extent = axis(cbox.hi, ax) - cmin;
+		if (level + medianLevels(n) >= stackSize - 1) {
+			std::nth_element(&prims[begin], &prims[begin + n / 2], &prims[begin] + n, [&](int a, int b) {
+				return axis(centers[a], ax) < axis(centers[b], ax);
+			});
+			return makeLeaf(id, begin, n, bounds, centers, level);
+		}
+		if (n <= 1 || extent <= 0) return makeLeaf(id, begin, n, bounds, centers, level);
 
-		//create a Ray from the surface point and the sampled direction and ray trace
-		Ray y(x, i.normalize());
-		totalRad = totalRad + receivedRadiance(y, depth + 1, obj.brdf.isSpecular())
-			.mult(obj.brdf.eval(n, o, i)) * (n.dot(i) / (pdf * p));
+		AABB binBox[numBins];
+		int binCount[numBins] = { 0 };
+		double scale = numBins / extent;
+		for (int i = begin; i < end; ++i) {
+			int b = std::min(numBins - 1, int((axis(centers[prims[i]], ax) - cmin) * scale));
+			binCount[b]++;
+			binBox[b].expand(bounds[prims[i]]);
+		}
 
-	}
+		// Sweep from the right, then from the left, to evaluate every split plane
+		double rightCost[numBins];
+		AABB acc;
+		int cnt = 0;
+		for (int b = numBins - 1; b > 0; --b) {
+			acc.expand(binBox[b]); cnt += binCount[b];
+			rightCost[b] = cnt * acc.area();
+		}
+		acc = AABB(); cnt = 0;
+		double bestCost = 1e300;
+		int bestSplit = -1;
+		for (int b = 0; b < numBins - 1; ++b) {
+			acc.expand(binBox[b]); cnt += binCount[b];
+			double cost = cnt * acc.area() + rightCost[b + 1];
+			if (cnt && cnt < n && cost < bestCost) { bestCost = cost; bestSplit = b; }
+		}
 
-	return flag ? obj.e + totalRad : totalRad;
+		// Two child box tests per interior node, each about as costly as a sphere test
+		double leafCost = double(n);
+		bestCost = 2.0 + bestCost / box.area();
+		if (bestSplit < 0 || (n <= maxLeafSize && leafCost <= bestCost))
+			return makeLeaf(id, begin, n, bounds, centers, level);
 
-	/*Ray out(x, o);
+		int *mid = std::partition(&prims[begin], &prims[begin] + n, [&](int p) {
+			return std::min(numBins - 1, int((axis(centers[p], ax) - cmin) * scale)) <= bestSplit;
+		});
+		int m = int(mid - &prims[0]);
 
-	return directRad + radiance(obj, out, n, depth, flag);*/
+		buildNode(bounds, centers, begin, m, level + 1);
+		int second = buildNode(bounds, centers, m, end, level + 1);
+		nodes[id].offset = second;
+		nodes[id].axis = (unsigned short)ax;
+		return id;
+	}
 
-}
+	int makeLeaf(int id, int begin, int n, const std::vector<AABB> &bounds, const std::vector<Vec> &centers,
+		int level) {
+		// Oversized leaves only happen when all centroids coincide or near the
+		// depth limit; split by count
+		if (n > maxLeafSize) {
+			int m = begin + n / 2;
+			buildNode(bounds, centers, begin, m, level + 1);
+			int second = buildNode(bounds, centers, m, begin + n, level + 1);
+			nodes[id].offset = second;
+			return id;
+		}
+		nodes[id].offset = begin;
+		nodes[id].count = (unsigned short)n;
+		return id;
+	}
+};
 
 
 /*
-* Main function (do not modify)
+* Light selection
+*
+* Emissive spheres are collected once at startup. Next-event estimation picks
+* one light per shading point, either from a power-weighted alias table or by
+* descending a light BVH that weighs each subtree by power over squared
+* distance, so the per-vertex cost does not grow with the number of lights.
 */
 
-int main(int argc, char *argv[]) {
-	int nworkers = omp_get_num_procs();
-	omp_set_num_threads(nworkers);
-	rng.init(nworkers);
+enum LightSelect { LIGHTS_POWER, LIGHTS_BVH };
 
-	int w = 480, h = 360, samps = argc == 2 ? atoi(argv[1]) / 4 : 1; // # samples
-	Vec cx = Vec(w*.5135 / h), cy = (cx.cross(cam.d)).normalize()*.5135;
-	std::vector<Vec> c(w*h);
+struct LightNode {
+	Vec center;       // bounding sphere of the lights below
+	double radius;
+	double power;
+	int child[2];     // -1 for leaves
+	int light;        // index into LightSet::ids for leaves
+};
 
-#pragma omp parallel for schedule(dynamic, 1)
-	for (int y = 0; y < h; y++) {
-		for (int x = 0; x < w; x++) {
-			const int i = (h - y - 1)*w + x;
-
-			for (int sy = 0; sy < 2; ++sy) {
-				for (int sx = 0; sx < 2; ++sx) {
-					Vec r;
-					for (int s = 0; s<samps; s++) {
-						double r1 = 2 * rng(), dx = r1<1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-						double r2 = 2 * rng(), dy = r2<1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-						Vec d = cx*(((sx + .5 + dx) / 2 + x) / w - .5) +
-							cy*(((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
-						r = r + receivedRadiance(Ray(cam.o, d.normalize()), 1, true)*(1. / samps);
-					}
-					c[i] = c[i] + Vec(clamp(r.x), clamp(r.y), clamp(r.z))*.25;
-				}
+struct LightSet {
+	std::vector<int> ids;          // sphere ids of the emitters
+	std::vector<double> pmf;       // power-proportional selection probability
+	std::vector<double> aliasProb;
+	std::vector<int> alias;
+	std::vector<LightNode> nodes;  // root is node 0
+	std::vector<uint64_t> paths;   // per light, the child choices root -> leaf
+	std::vector<int> pathLength;
+	std::vector<int> index;        // sphere id -> light index, -1 if not emissive
+
+	void build(const Sphere *s, int n) {
+		ids.clear();
+		index.assign(n, -1);
+		std::vector<double> power;
+		for (int i = 0; i < n; ++i) {
+			double p = luminance(s[i].e) * 4.0 * PI * s[i].rad * s[i].rad * PI;
+			if (p <= 0) continue;
+			index[i] = int(ids.size());
+			ids.push_back(i);
+			power.push_back(p);
+		}
+		buildAlias(power);
+
+		nodes.clear();
+		paths.assign(ids.size(), 0);
+		pathLength.assign(ids.size(), 0);
+		std::vector<int> order(ids.size());
+		for (size_t i = 0; i < order.size(); ++i) order[i] = int(i);
+		if (!ids.empty()) buildNode(s, power, order, 0, int(order.size()), 0, 0);
+	}
+
+	int size() const { return int(ids.size()); }
+
+	// Picks a light for shading point x from u in [0, 1); pdf is the
+	// probability of the choice
+	bool sample(int mode, const Vec &x, double u, int &light, double &pdf) const {
+		if (ids.empty()) return false;
+		if (mode == LIGHTS_BVH) {
+			int node = 0;
+			pdf = 1;
+			while (nodes[node].child[0] >= 0) {
+				double pl = childProbability(nodes[node], x);
+				if (u < pl) { node = nodes[node].child[0]; u /= pl; pdf *= pl; }
+				else { node = nodes[node].child[1]; u = (u - pl) / (1 - pl); pdf *= 1 - pl; }
+				u = std::min(u, 1 - 1e-12);
 			}
+			light = nodes[node].light;
+			return pdf > 0;
 		}
-#pragma omp critical
-		fprintf(stderr, "\rRendering (%d spp) %6.2f%%", samps * 4, 100.*y / (h - 1));
+		double scaled = u * ids.size();
+		int k = std::min(int(scaled), int(ids.size()) - 1);
+		light = scaled - k < aliasProb[k] ? k : alias[k];
+		pdf = pmf[light];
+		return true;
 	}
-	fprintf(stderr, "\n");
 
-	// Write resulting image to a PPM file
-	FILE *f = fopen("image.ppm", "w");
-	fprintf(f, "P3\n%d %d\n%d\n", w, h, 255);
-	for (int i = 0; i<w*h; i++)
-		fprintf(f, "%d %d %d ", toInt(c[i].x), toInt(c[i].y), toInt(c[i].z));
-	fclose(f);
+	// Probability that sample() picks light `light` at x
+	double pdf(int mode, const Vec &x, int light) const {
+		if (mode != LIGHTS_BVH) return pmf[light];
+		double p = 1;
+		int node = 0;
+		for (int d = 0; d < pathLength[light]; ++d) {
+			double pl = childProbability(nodes[node], x);
+			int side = int(paths[light] >> d & 1);
+			p *= side ? 1 - pl : pl;
+			node = nodes[node].child[side];
+		}
+		return p;
+	}
 
-	return 0;
-}
\ No newline at end of file
+private:
+	static double importance(const LightNode &node, const Vec &x) {
+		Vec d = node.center - x;
+		return node.power / std::max<double>(d.dot(d), node.radius * node.radius);
+	}
+
+	double childProbability(const LightNode &node, const Vec &x) const {
+		double l = importance(nodes[node.child[0]], x), r = importance(nodes[node.child[1]], x);
+		return l + r > 0 ? l / (l + r) : 0.5;
+	}
+
+	// Vose's alias method over the light powers
+	void buildAlias(const std::vector<double> &power) {
+		int n = int(power.size());
+		double total = 0;
+		for (int i = 0; i < n; ++i) total += power[i];
+		pmf.resize(n);
+		aliasProb.assign(n, 1.0);
+		alias.resize(n);
+		std::vector<double> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; ++i) {
+			pmf[i] = power[i] / total;
+			scaled[i] = pmf[i] * n;
+			alias[i] = i;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			int s = small.back(), l = large.back();
+			small.pop_back();
+			aliasProb[s] = scaled[s];
+			alias[s] = l;
+			scaled[l] -= 1 - scaled[s];
+			if (scaled[l] < 1) { large.pop_back(); small.push_back(l); }
+		}
+	}
+
+	// Median split on the widest axis of light centers
+	int buildNode(const Sphere *s, const std::vector<double> &power, std::vector<int> &order,
+		int begin, int end, uint64_t path, int depth) {
+		AABB box;
+		double p = 0;
+		for (int i = begin; i < end; ++i) {
+			box.expand(sphereBounds(s[ids[order[i]]]));
+			p += power[order[i]];
+		}
+		LightNode node;
+		node.center = box.center();
+		node.radius = std::sqrt((box.hi - box.lo).dot(box.hi - box.lo)) * 0.5;
+		node.power = p;
+		node.child[0] = node.child[1] = -1;
+		node.light = -1;
+		int id = int(nodes.size());
+		nodes.push_back(node);
+
+		if (end - begin == 1 || depth == 63) {
+			nodes[id].light = order[begin];
+			paths[order[begin]] = path;
+			pathLength[order[begin]] = depth;
+			return id;
+		}
+
+		AABB cbox;
+		for (int i = begin; i < end; ++i) cbox.expand(s[ids[order[i]]].p);
+		int ax = cbox.maxAxis(), mid = (begin + end) / 2;
+		std::nth_element(&order[begin], &order[mid], &order[0] + end, [&](int a, int b) {
+			return axis(s[ids[a]].p, ax) < axis(s[ids[b]].p, ax); });
+
+		int l = buildNode(s, power, order, begin, mid, path, depth + 1);
+		int r = buildNode(s, power, order, mid, end, path | (uint64_t(1) << depth), depth + 1);
+		nodes[id].child[0] = l;
+		nodes[id].child[1] = r;
+		return id;
+	}
+};
+
+
+/*
+* Sampling functions
+*/
+
+// Cosine-weighted hemisphere sample around f.n; pdf is per unit solid angle
+void uniformRandomPSA(const Frame &f, const Vec &o, Vec &i, Real &pdf, Sampler &sampler) {
+	double u1, u2;
+	sampler.get2D(u1, u2);
+	Real z = sqrt(u1);
+	Real r = sqrt(1.0 - z * z);
+	Real phi = 2.0 * PI * u2;
+	Real x = r * cos(phi);
+	Real y = r * sin(phi);
+
+	i = f.toWorld(x, y, z);
+	pdf = z / PI;
+}
+
+/*
+* BRDFs
+*/
+
+template <int Type> struct BRDFKernel;
+
+// Ideal diffuse BRDF
+template <> struct BRDFKernel<BRDF_DIFFUSE> {
+	static const bool specular = false;
+
+	static Vec eval(const Vec &kd, const Frame &, const Vec &, const Vec &) {
+		return kd * (1.0 / PI);
+	}
+
+	static void sample(const Vec &, const Frame &f, const Vec &o, Vec &i, Real &pdf, Sampler &sampler) {
+		uniformRandomPSA(f, o, i, pdf, sampler);
+	}
+
+	static Real pdf(const Vec &, const Frame &f, const Vec &, const Vec &i) {
+		return std::max<Real>(0, f.n.dot(i)) / PI;
+	}
+};
+
+// Ideal mirror
+template <> struct BRDFKernel<BRDF_SPECULAR> {
+	static const bool specular = true;
+
+	static void mirroredDirection(const Vec &n, const Vec &o, Vec &i) {
+		i = n * 2.0 * n.dot(o) - o;
+	}
+
+	static Vec eval(const Vec &ks, const Frame &f, const Vec &o, const Vec &i) {
+		Vec mirrored;
+		mirroredDirection(f.n, o, mirrored);
+		Vec i_n = i;
+		mirrored.normalize();
+		i_n.normalize();
+
+		if (std::abs(i_n.x - mirrored.x) <= 1e-4 &&
+			std::abs(i_n.y - mirrored.y) <= 1e-4 &&
+			std::abs(i_n.z - mirrored.z) <= 1e-4)
+			return ks * (1 / f.n.dot(i));
+
+		return Vec();
+	}
+
+	static void sample(const Vec &, const Frame &f, const Vec &o, Vec &i, Real &pdf, Sampler &) {
+		mirroredDirection(f.n, o, i);
+		pdf = 1.0;
+	}
+
+	static Real pdf(const Vec &, const Frame &, const Vec &, const Vec &) {
+		return 0.0;   // a delta distribution never matches another technique
+	}
+};
+
+inline Vec BRDF::eval(const Frame &f, const Vec &o, const Vec &i) const {
+	switch (type) {
+	case BRDF_SPECULAR: return BRDFKernel<BRDF_SPECULAR>::eval(k, f, o, i);
+	default:            return BRDFKernel<BRDF_DIFFUSE>::eval(k, f, o, i);
+	}
+}
+
+inline void BRDF::sample(const Frame &f, const Vec &o, Vec &i, Real &pdf, Sampler &sampler) const {
+	switch (type) {
+	case BRDF_SPECULAR: BRDFKernel<BRDF_SPECULAR>::sample(k, f, o, i, pdf, sampler); break;
+	default:            BRDFKernel<BRDF_DIFFUSE>::sample(k, f, o, i, pdf, sampler); break;
+	}
+}
+
+inline Real BRDF::pdf(const Frame &f, const Vec &o, const Vec &i) const {
+	switch (type) {
+	case BRDF_SPECULAR: return BRDFKernel<BRDF_SPECULAR>::pdf(k, f, o, i);
+	default:            return BRDFKernel<BRDF_DIFFUSE>::pdf(k, f, o, i);
+	}
+}
+
+struct DiffuseBRDF : public BRDF {
+	DiffuseBRDF(Vec kd_) : BRDF(BRDF_DIFFUSE, kd_) {}
+};
+
+struct SpecularBRDF : public BRDF {
+	SpecularBRDF(Vec ks_) : BRDF(BRDF_SPECULAR, ks_) {}
+};
+
+
+/*
+* Scene description
+*
+* Text scenes hold one statement per line; '#' starts a comment:
+*
+*   camera   ox oy oz  dx dy dz  fov     position, view direction and the
+*                                        half height of the image plane at
+*                                        unit distance
+*   material name diffuse|specular r g b
+*   sphere   radius  x y z  material [emit r g b]
+*   mesh     file  material              triangles of a binary mesh file,
+*                                        relative to the scene's directory
+*
+* Materials must be declared before use; spheres with emission are lights
+* (meshes do not emit). Mesh files (--convert-mesh) hold vertex position
+* planes and index triples in 64-byte aligned sections and are mapped, not
+* read. Binary scenes (--save-scene) hold the same data, the meshes
+* included, plus the built BVH; sphere and BVH sections are copied in
+* without parsing or building while mesh sections stay mapped. Both are
+* specific to the byte order and ABI that wrote them.
+*/
+
+struct Camera {
+	Vec o, d;   // position and unit view direction
+	Real fov;
+
+	// Image-plane axes for a w x h image
+	void axes(int w, int h, Vec &cx, Vec &cy) const {
+		cx = Vec(w * fov / h);
+		cy = cx.cross(d).normalize() * fov;
+	}
+};
+
+struct Scene {
+	std::vector<BRDF> materials;
+	std::vector<Sphere> spheres;   // refer into materials
+	std::vector<Mesh> meshes;      // likewise
+	Camera camera;
+};
+
+// The built-in scene, used without --scene
+const char *cornellBox =
+	"camera   50 52 295.6   0 -0.042612 -1   0.5135\n"
+	"material leftWall   diffuse  .75 .25 .25\n"
+	"material rightWall  diffuse  .25 .25 .75\n"
+	"material otherWall  diffuse  .75 .75 .75\n"
+	"material blackSurf  diffuse  0 0 0\n"
+	"material brightSurf diffuse  .9 .9 .9\n"
+	"material shinySurf  specular .999 .999 .999\n"
+	"sphere 1e5   100001 40.8 81.6     leftWall     # Left\n"
+	"sphere 1e5   -99901 40.8 81.6     rightWall    # Right\n"
+	"sphere 1e5   50 40.8 1e5          otherWall    # Back\n"
+	"sphere 1e5   50 1e5 81.6          otherWall    # Bottom\n"
+	"sphere 1e5   50 -99918.4 81.6     otherWall    # Top\n"
+	"sphere 16.5  27 16.5 47           brightSurf   # Ball 1\n"
+	"sphere 16.5  73 16.5 78           shinySurf    # Ball 2\n"
+	"sphere 5     50 70 81.6           blackSurf emit 50 50 50   # Light\n";
+
+Scene scene;
+
+struct SceneSettings {
+	const char *path;       // scene to load instead of cornellBox
+	const char *savePath;   // write the loaded scene here as a binary scene and exit
+
+	SceneSettings() : path(0), savePath(0) {}
+} sceneFiles;
+
+// The loaded scene as the renderer sees it, set up by useScene()
+const Sphere *spheres = 0;
+int numSpheres = 0;
+const Mesh *meshes = 0;
+int numMeshes = 0;
+Camera cam;
+
+// Acceleration structure over spheres[] and meshes[], and the emitters among
+// them, built once in main()
+BVH bvh;
+LightSet lights;
+
+// On-disk records of a binary scene. Offsets are from the start of the file.
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;     // sceneByteOrder as written
+	uint32_t numMaterials, numSpheres, numNodes, soaSize;
+	double camera[7];       // o, d, fov
+	uint64_t materials, spheres, nodes, prims, soa;
+	uint32_t numMeshes, numTris;
+	uint64_t meshes, tris;
+};
+
+struct MaterialRecord {
+	int32_t type;
+	int32_t pad;
+	double k[3];
+};
+
+struct SphereRecord {
+	double rad, p[3], e[3];
+	int32_t material;
+	int32_t pad;
+};
+
+// Sections of one mesh, in a binary scene
+struct MeshRecord {
+	uint32_t numVertices, numTriangles;
+	int32_t material;
+	int32_t pad;
+	uint64_t x, y, z, indices;
+};
+
+struct MeshFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t numVertices, numTriangles;
+	uint64_t x, y, z, indices;
+};
+
+const char sceneMagic[8] = { 'S', 'P', 'T', 'S', 'C', 'E', 'N', 'E' };
+const char meshMagic[8] = { 'S', 'P', 'T', 'M', 'E', 'S', 'H', 0 };
+const uint32_t sceneVersion = 2, meshVersion = 1, sceneByteOrder = 0x01020304;
+
+// Read-only view of a whole file: mapped where mmap exists, read otherwise
+struct MappedFile {
+	MappedFile() : data(0), size(0) {}
+	~MappedFile() { close(); }
+
+	bool open(const char *path) {
+		close();
+#ifndef _WIN32
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(0, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data = (const unsigned char *)p;
+				size = size_t(st.st_size);
+			}
+		}
+		::close(fd);
+		return data != 0;
+#else
+		FILE *f = fopen(path, "rb");
+		if (!f) return false;
+		fseek(f, 0, SEEK_END);
+		long n = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (n > 0) {
+			buffer.resize(size_t(n));
+			if (fread(&buffer[0], 1, buffer.size(), f) == buffer.size()) {
+				data = &buffer[0];
+				size = buffer.size();
+			}
+		}
+		fclose(f);
+		return data != 0;
+#endif
+	}
+
+	void close() {
+#ifndef _WIN32
+		if (data) munmap((void *)data, size);
+#else
+		buffer.clear();
+#endif
+		data = 0;
+		size = 0;
+	}
+
+	// Pointer to count T at offset, or null if that runs past the end. An
+	// empty section may lie past the end, as nothing after it was written.
+	template <class T>
+	const T *at(uint64_t offset, uint64_t count) const {
+		if (!count && data) return (const T *)data;
+		if (offset > size || count > (size - offset) / sizeof(T)) return 0;
+		return (const T *)(data + offset);
+	}
+
+	const unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	std::vector<unsigned char> buffer;
+#endif
+};
+
+inline uint64_t alignSection(uint64_t pos) { return (pos + 63) & ~uint64_t(63); }
+
+// Places sections of the given sizes one after another from start, each on
+// a 64-byte boundary
+void layoutSections(const size_t *bytes, int n, uint64_t start, uint64_t *offsets) {
+	uint64_t pos = alignSection(start);
+	for (int k = 0; k < n; ++k) {
+		offsets[k] = pos;
+		pos = alignSection(pos + bytes[k]);
+	}
+}
+
+bool writeSections(FILE *f, const void *const *data, const size_t *bytes, const uint64_t *offsets, int n) {
+	bool ok = true;
+	for (int k = 0; ok && k < n; ++k)
+		ok = fseek(f, long(offsets[k]), SEEK_SET) == 0 && (!bytes[k] || fwrite(data[k], 1, bytes[k], f) == bytes[k]);
+	return ok;
+}
+
+// Points m at the mesh sections of file, checking that they are present and
+// that every index names a vertex
+bool mapMesh(const char *path, const std::shared_ptr<MappedFile> &file, uint32_t nv, uint32_t nt,
+	const uint64_t offsets[4], Mesh &m) {
+	m.x = file->at<float>(offsets[0], nv);
+	m.y = file->at<float>(offsets[1], nv);
+	m.z = file->at<float>(offsets[2], nv);
+	m.indices = file->at<uint32_t>(offsets[3], 3 * uint64_t(nt));
+	if (!m.x || !m.y || !m.z || !m.indices || nv > INT32_MAX || nt > INT32_MAX) {
+		fprintf(stderr, "%s: truncated mesh\n", path);
+		return false;
+	}
+	for (uint64_t k = 0; k < 3 * uint64_t(nt); ++k)
+		if (m.indices[k] >= nv) {
+			fprintf(stderr, "%s: triangle %d refers to a missing vertex\n", path, int(k / 3));
+			return false;
+		}
+	m.numVertices = int(nv);
+	m.numTriangles = int(nt);
+	m.storage = file;
+	return true;
+}
+
+// Maps a mesh file; m gets no material or ids yet
+bool loadMesh(const char *path, Mesh &m) {
+	std::shared_ptr<MappedFile> file(new MappedFile);
+	if (!file->open(path)) {
+		fprintf(stderr, "Cannot read mesh %s\n", path);
+		return false;
+	}
+	const MeshFileHeader *hdr = file->at<MeshFileHeader>(0, 1);
+	if (!hdr || memcmp(hdr->magic, meshMagic, sizeof(meshMagic)) || hdr->version != meshVersion ||
+		hdr->byteOrder != sceneByteOrder) {
+		fprintf(stderr, "%s: not a mesh file of this version and byte order\n", path);
+		return false;
+	}
+	const uint64_t offsets[4] = { hdr->x, hdr->y, hdr->z, hdr->indices };
+	return mapMesh(path, file, hdr->numVertices, hdr->numTriangles, offsets, m);
+}
+
+bool writeMesh(const char *path, const Mesh &m) {
+	MeshFileHeader hdr = MeshFileHeader();
+	memcpy(hdr.magic, meshMagic, sizeof(meshMagic));
+	hdr.version = meshVersion;
+	hdr.byteOrder = sceneByteOrder;
+	hdr.numVertices = uint32_t(m.numVertices);
+	hdr.numTriangles = uint32_t(m.numTriangles);
+
+	const void *data[] = { m.x, m.y, m.z, m.indices };
+	const size_t plane = size_t(m.numVertices) * sizeof(float);
+	const size_t bytes[] = { plane, plane, plane, size_t(m.numTriangles) * 3 * sizeof(uint32_t) };
+	uint64_t offsets[4];
+	layoutSections(bytes, 4, sizeof(hdr), offsets);
+	hdr.x = offsets[0]; hdr.y = offsets[1]; hdr.z = offsets[2]; hdr.indices = offsets[3];
+
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && writeSections(f, data, bytes, offsets, 4);
+	return fclose(f) == 0 && ok;
+}
+
+// Writes the vertices and faces of a Wavefront OBJ file as a mesh file,
+// fanning polygons into triangles. Everything else in it is ignored.
+bool convertMesh(const char *objPath, const char *meshPath) {
+	FILE *f = fopen(objPath, "r");
+	if (!f) {
+		fprintf(stderr, "Cannot read %s\n", objPath);
+		return false;
+	}
+	std::vector<float> x, y, z;
+	std::vector<uint32_t> indices;
+	char buf[4096];
+	bool ok = true;
+	for (int line = 1; ok && fgets(buf, sizeof(buf), f); ++line) {
+		const bool space = buf[0] && (buf[1] == ' ' || buf[1] == '\t');
+		if (buf[0] == 'v' && space) {
+			double v[3];
+			ok = sscanf(buf + 2, "%lf %lf %lf", &v[0], &v[1], &v[2]) == 3;
+			x.push_back(float(v[0])); y.push_back(float(v[1])); z.push_back(float(v[2]));
+		}
+		else if (buf[0] == 'f' && space) {
+			// "f v1 v2 v3 ...", each vertex possibly followed by /vt/vn
+			uint32_t first = 0, prev = 0;
+			char *p = buf + 1, *end;
+			for (int count = 0; ok; ++count) {
+				long k = strtol(p, &end, 10);
+				if (end == p) break;
+				p = end + strcspn(end, " \t\r\n");
+				if (k < 0) k += long(x.size()) + 1;   // relative to the last vertex
+				ok = k >= 1 && k <= long(x.size());
+				uint32_t v = uint32_t(k - 1);
+				if (count == 0) first = v;
+				else if (count >= 2) { indices.push_back(first); indices.push_back(prev); indices.push_back(v); }
+				prev = v;
+			}
+		}
+		if (!ok) fprintf(stderr, "%s:%d: malformed vertex or face\n", objPath, line);
+	}
+	fclose(f);
+	if (!ok) return false;
+
+	Mesh m;
+	m.x = x.data(); m.y = y.data(); m.z = z.data();
+	m.indices = indices.data();
+	m.numVertices = int(x.size());
+	m.numTriangles = int(indices.size() / 3);
+	if (!writeMesh(meshPath, m)) {
+		fprintf(stderr, "Cannot write %s\n", meshPath);
+		return false;
+	}
+	printf("%s: %d vertices, %d triangles\n", meshPath, m.numVertices, m.numTriangles);
+	return true;
+}
+
+// Creates out.spheres from the records, once out.materials is complete
+void addSpheres(const std::vector<SphereRecord> &records, Scene &out) {
+	out.spheres.clear();
+	out.spheres.reserve(records.size());
+	for (size_t k = 0; k < records.size(); ++k) {
+		const SphereRecord &r = records[k];
+		out.spheres.push_back(Sphere(r.rad, Vec(r.p[0], r.p[1], r.p[2]), Vec(r.e[0], r.e[1], r.e[2]),
+			out.materials[r.material]));
+	}
+}
+
+// Gives out.meshes[k] material materials[k] and numbers its triangles after
+// the spheres and the meshes before it, once out.spheres is complete
+void linkMeshes(const std::vector<int> &materials, Scene &out) {
+	int id = int(out.spheres.size());
+	for (size_t k = 0; k < out.meshes.size(); ++k) {
+		out.meshes[k].brdf = &out.materials[materials[k]];
+		out.meshes[k].firstId = id;
+		id += out.meshes[k].numTriangles;
+	}
+}
+
+void buildBVH(const Scene &s, BVH &accel) {
+	accel.build(s.spheres.data(), int(s.spheres.size()), s.meshes.data(), int(s.meshes.size()));
+}
+
+// Parses a text scene; name is only used in error messages and to find
+// mesh files
+bool parseScene(const char *name, const char *text, Scene &out) {
+	std::vector<std::string> names;
+	std::vector<SphereRecord> records;
+	std::vector<int> meshMaterials;
+	bool hasCamera = false;
+	out.materials.clear();
+	out.meshes.clear();
+
+	for (int line = 1; *text; ++line) {
+		const char *end = strchr(text, '\n');
+		std::string stmt(text, end ? end - text : strlen(text));
+		text = end ? end + 1 : text + stmt.size();
+		size_t hash = stmt.find('#');
+		if (hash != std::string::npos) stmt.resize(hash);
+
+		char word[64], arg[64], extra[64], file[1024];
+		double v[8];
+		int used = 0;
+		if (sscanf(stmt.c_str(), "%63s", word) != 1) continue;
+
+		if (!strcmp(word, "camera") && sscanf(stmt.c_str(), "%*s %lf %lf %lf %lf %lf %lf %lf %n",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &used) == 7 && !stmt[used]) {
+			out.camera.o = Vec(v[0], v[1], v[2]);
+			out.camera.d = Vec(v[3], v[4], v[5]).normalize();
+			out.camera.fov = v[6];
+			hasCamera = true;
+		}
+		else if (!strcmp(word, "material") && sscanf(stmt.c_str(), "%*s %63s %63s %lf %lf %lf %n",
+			arg, extra, &v[0], &v[1], &v[2], &used) == 5 && !stmt[used]) {
+			int type = !strcmp(extra, "diffuse") ? BRDF_DIFFUSE : !strcmp(extra, "specular") ? BRDF_SPECULAR : -1;
+			if (type < 0) {
+				fprintf(stderr, "%s:%d: unknown material type '%s'\n", name, line, extra);
+				return false;
+			}
+			names.push_back(arg);
+			out.materials.push_back(BRDF(type, Vec(v[0], v[1], v[2])));
+		}
+		else if (!strcmp(word, "sphere") && sscanf(stmt.c_str(), "%*s %lf %lf %lf %lf %63s %n",
+			&v[0], &v[1], &v[2], &v[3], arg, &used) == 5) {
+			SphereRecord r = SphereRecord();
+			r.rad = v[0];
+			r.p[0] = v[1]; r.p[1] = v[2]; r.p[2] = v[3];
+			r.material = int32_t(std::find(names.begin(), names.end(), arg) - names.begin());
+			if (r.material == int32_t(names.size())) {
+				fprintf(stderr, "%s:%d: undeclared material '%s'\n", name, line, arg);
+				return false;
+			}
+			int more = 0;
+			if (sscanf(stmt.c_str() + used, "emit %lf %lf %lf %n", &r.e[0], &r.e[1], &r.e[2], &more) == 3) used += more;
+			if (stmt.find_first_not_of(" \t\r", used) != std::string::npos) {
+				fprintf(stderr, "%s:%d: malformed sphere\n", name, line);
+				return false;
+			}
+			records.push_back(r);
+		}
+		else if (!strcmp(word, "mesh") && sscanf(stmt.c_str(), "%*s %1023s %63s %n", file, arg, &used) == 2 &&
+			!stmt[used]) {
+			int material = int(std::find(names.begin(), names.end(), arg) - names.begin());
+			if (material == int(names.size())) {
+				fprintf(stderr, "%s:%d: undeclared material '%s'\n", name, line, arg);
+				return false;
+			}
+			std::string path = file;
+			const char *slash = strrchr(name, '/');
+			if (file[0] != '/' && slash) path = std::string(name, slash + 1) + file;
+			Mesh m;
+			if (!loadMesh(path.c_str(), m)) return false;
+			out.meshes.push_back(m);
+			meshMaterials.push_back(material);
+		}
+		else {
+			fprintf(stderr, "%s:%d: cannot parse '%s'\n", name, line, stmt.c_str());
+			return false;
+		}
+	}
+
+	if (!hasCamera || (records.empty() && out.meshes.empty())) {
+		fprintf(stderr, "%s: a scene needs a camera and at least one sphere or mesh\n", name);
+		return false;
+	}
+	addSpheres(records, out);
+	linkMeshes(meshMaterials, out);
+	return true;
+}
+
+// Fails when traversal of a BVH would outgrow its stack
+bool checkBVHDepth(const char *path, const BVHNode *nodes, uint32_t numNodes) {
+	if (BVH::depth(nodes, int(numNodes)) <= BVH::stackSize) return true;
+	fprintf(stderr, "%s: BVH is deeper than %d levels\n", path, BVH::stackSize);
+	return false;
+}
+
+// Writes s and its BVH as a binary scene; refuses a BVH the loader would reject
+bool saveSceneBinary(const char *path, const Scene &s, const BVH &accel) {
+	if (!checkBVHDepth(path, accel.nodes.data(), uint32_t(accel.nodes.size()))) return false;
+	SceneFileHeader hdr = SceneFileHeader();
+	memcpy(hdr.magic, sceneMagic, sizeof(sceneMagic));
+	hdr.version = sceneVersion;
+	hdr.byteOrder = sceneByteOrder;
+	hdr.numMaterials = uint32_t(s.materials.size());
+	hdr.numSpheres = uint32_t(s.spheres.size());
+	hdr.numNodes = uint32_t(accel.nodes.size());
+	hdr.soaSize = uint32_t(accel.soa.ids.size());
+	hdr.numMeshes = uint32_t(s.meshes.size());
+	hdr.numTris = uint32_t(accel.tris.size());
+	const Camera &c = s.camera;
+	double camera[7] = { c.o.x, c.o.y, c.o.z, c.d.x, c.d.y, c.d.z, c.fov };
+	memcpy(hdr.camera, camera, sizeof(camera));
+
+	std::vector<MaterialRecord> materials(s.materials.size());
+	for (size_t k = 0; k < materials.size(); ++k) {
+		const BRDF &m = s.materials[k];
+		materials[k].type = m.type;
+		materials[k].k[0] = m.k.x; materials[k].k[1] = m.k.y; materials[k].k[2] = m.k.z;
+	}
+	std::vector<SphereRecord> records(s.spheres.size());
+	for (size_t k = 0; k < records.size(); ++k) {
+		const Sphere &sp = s.spheres[k];
+		SphereRecord &r = records[k];
+		r.rad = sp.rad;
+		r.p[0] = sp.p.x; r.p[1] = sp.p.y; r.p[2] = sp.p.z;
+		r.e[0] = sp.e.x; r.e[1] = sp.e.y; r.e[2] = sp.e.z;
+		r.material = int32_t(&sp.brdf - &s.materials[0]);
+	}
+	std::vector<MeshRecord> meshRecords(s.meshes.size());
+
+	// Sections in file order, each starting on a 64-byte boundary; every mesh
+	// adds its four at the end
+	std::vector<const void *> data = { materials.data(), records.data(), accel.nodes.data(), accel.prims.data(),
+		&accel.soa.cx[0], &accel.soa.cy[0], &accel.soa.cz[0], &accel.soa.r2[0], &accel.soa.ids[0],
+		meshRecords.data(), accel.tris.data() };
+	std::vector<size_t> bytes = { materials.size() * sizeof(MaterialRecord), records.size() * sizeof(SphereRecord),
+		accel.nodes.size() * sizeof(BVHNode), accel.prims.size() * sizeof(int),
+		hdr.soaSize * sizeof(double), hdr.soaSize * sizeof(double), hdr.soaSize * sizeof(double),
+		hdr.soaSize * sizeof(double), hdr.soaSize * sizeof(int),
+		meshRecords.size() * sizeof(MeshRecord), accel.tris.size() * sizeof(TriRef) };
+	const size_t fixed = data.size();
+	for (size_t k = 0; k < s.meshes.size(); ++k) {
+		const Mesh &m = s.meshes[k];
+		const size_t plane = size_t(m.numVertices) * sizeof(float);
+		const void *mdata[] = { m.x, m.y, m.z, m.indices };
+		const size_t mbytes[] = { plane, plane, plane, size_t(m.numTriangles) * 3 * sizeof(uint32_t) };
+		data.insert(data.end(), mdata, mdata + 4);
+		bytes.insert(bytes.end(), mbytes, mbytes + 4);
+	}
+	const int sections = int(bytes.size());
+	std::vector<uint64_t> offsets(sections);
+	layoutSections(&bytes[0], sections, sizeof(hdr), &offsets[0]);
+	hdr.materials = offsets[0];
+	hdr.spheres = offsets[1];
+	hdr.nodes = offsets[2];
+	hdr.prims = offsets[3];
+	hdr.soa = offsets[4];
+	hdr.meshes = offsets[9];
+	hdr.tris = offsets[10];
+	for (size_t k = 0; k < s.meshes.size(); ++k) {
+		const Mesh &m = s.meshes[k];
+		MeshRecord &r = meshRecords[k];
+		r.numVertices = uint32_t(m.numVertices);
+		r.numTriangles = uint32_t(m.numTriangles);
+		r.material = int32_t(m.brdf - &s.materials[0]);
+		r.x = offsets[fixed + 4 * k];
+		r.y = offsets[fixed + 4 * k + 1];
+		r.z = offsets[fixed + 4 * k + 2];
+		r.indices = offsets[fixed + 4 * k + 3];
+	}
+
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && writeSections(f, &data[0], &bytes[0], &offsets[0], sections);
+	return fclose(f) == 0 && ok;
+}
+
+// Whether a BVH read from a file can be traversed without leaving its
+// arrays: children after their parent and inside nodes, depth within the
+// traversal stack, leaves inside the SoA (less its padding) and tris, and
+// every id naming an existing sphere or mesh triangle
+bool checkSceneBVH(const char *path, const BVHNode *nodes, uint32_t numNodes, const int *prims, uint32_t n,
+	const int *ids, const double *r2, uint32_t soaSize, const TriRef *tris, uint32_t numTris, const Scene &s) {
+	for (uint32_t k = 0; k < numNodes; ++k) {
+		const BVHNode &node = nodes[k];
+		if (node.leaf()) {
+			if (node.offset < 0 || uint64_t(node.offset) + node.count > n || node.triOffset < 0 ||
+				node.triCount < 0 || uint64_t(node.triOffset) + uint64_t(node.triCount) > numTris) {
+				fprintf(stderr, "%s: BVH leaf %u is out of range\n", path, k);
+				return false;
+			}
+			continue;
+		}
+		if (node.axis > 2 || node.offset <= int64_t(k) || uint32_t(node.offset) >= numNodes || k + 1 >= numNodes) {
+			fprintf(stderr, "%s: BVH node %u has a bad child\n", path, k);
+			return false;
+		}
+	}
+	if (!checkBVHDepth(path, nodes, numNodes)) return false;
+	for (uint32_t k = 0; k < soaSize; ++k)
+		if (k < n ? ids[k] < 0 || uint32_t(ids[k]) >= n || prims[k] < 0 || uint32_t(prims[k]) >= n :
+			ids[k] != -1 || r2[k] >= 0) {
+			fprintf(stderr, "%s: BVH sphere slot %u is out of range\n", path, k);
+			return false;
+		}
+	for (uint32_t k = 0; k < numTris; ++k)
+		if (tris[k].mesh < 0 || size_t(tris[k].mesh) >= s.meshes.size() || tris[k].tri < 0 ||
+			tris[k].tri >= s.meshes[tris[k].mesh].numTriangles) {
+			fprintf(stderr, "%s: BVH triangle %u is out of range\n", path, k);
+			return false;
+		}
+	return true;
+}
+
+// Loads a binary scene and its BVH; meshes keep file mapped
+bool loadSceneBinary(const char *path, const std::shared_ptr<MappedFile> &file, Scene &out, BVH &accel) {
+	const SceneFileHeader *hdr = file->at<SceneFileHeader>(0, 1);
+	if (!hdr || hdr->version != sceneVersion || hdr->byteOrder != sceneByteOrder) {
+		fprintf(stderr, "%s: unsupported binary scene version or byte order\n", path);
+		return false;
+	}
+	const uint32_t n = hdr->numSpheres, soaSize = hdr->soaSize;
+	const MaterialRecord *materials = file->at<MaterialRecord>(hdr->materials, hdr->numMaterials);
+	const SphereRecord *records = file->at<SphereRecord>(hdr->spheres, n);
+	const BVHNode *nodes = file->at<BVHNode>(hdr->nodes, hdr->numNodes);
+	const int *prims = file->at<int>(hdr->prims, n);
+	// the SoA planes are separate sections, cx to r2 then ids
+	const uint64_t plane = alignSection(uint64_t(soaSize) * sizeof(double));
+	const double *soa[4];
+	for (int k = 0; k < 4; ++k) soa[k] = file->at<double>(hdr->soa + k * plane, soaSize);
+	const int *ids = file->at<int>(hdr->soa + 4 * plane, soaSize);
+	const MeshRecord *meshRecords = file->at<MeshRecord>(hdr->meshes, hdr->numMeshes);
+	const TriRef *tris = file->at<TriRef>(hdr->tris, hdr->numTris);
+	if (!materials || !records || !nodes || !prims || !soa[0] || !soa[1] || !soa[2] || !soa[3] || !ids ||
+		!meshRecords || !tris ||
+		!(n || hdr->numMeshes) || soaSize != n + SphereSoA::pad) {
+		fprintf(stderr, "%s: truncated or inconsistent binary scene\n", path);
+		return false;
+	}
+
+	out.materials.clear();
+	for (uint32_t k = 0; k < hdr->numMaterials; ++k)
+		out.materials.push_back(BRDF(materials[k].type, Vec(materials[k].k[0], materials[k].k[1], materials[k].k[2])));
+	std::vector<SphereRecord> spheres(records, records + n);
+	for (uint32_t k = 0; k < n; ++k)
+		if (spheres[k].material < 0 || uint32_t(spheres[k].material) >= hdr->numMaterials) {
+			fprintf(stderr, "%s: sphere %u has no material\n", path, k);
+			return false;
+		}
+	addSpheres(spheres, out);
+
+	out.meshes.assign(hdr->numMeshes, Mesh());
+	std::vector<int> meshMaterials(hdr->numMeshes);
+	uint64_t numTris = 0;
+	for (uint32_t k = 0; k < hdr->numMeshes; ++k) {
+		const MeshRecord &r = meshRecords[k];
+		const uint64_t offsets[4] = { r.x, r.y, r.z, r.indices };
+		if (!mapMesh(path, file, r.numVertices, r.numTriangles, offsets, out.meshes[k])) return false;
+		if (r.material < 0 || uint32_t(r.material) >= hdr->numMaterials) {
+			fprintf(stderr, "%s: mesh %u has no material\n", path, k);
+			return false;
+		}
+		meshMaterials[k] = r.material;
+		numTris += r.numTriangles;
+	}
+	if (numTris != hdr->numTris) {
+		fprintf(stderr, "%s: truncated or inconsistent binary scene\n", path);
+		return false;
+	}
+	linkMeshes(meshMaterials, out);
+	out.camera.o = Vec(hdr->camera[0], hdr->camera[1], hdr->camera[2]);
+	out.camera.d = Vec(hdr->camera[3], hdr->camera[4], hdr->camera[5]);
+	out.camera.fov = hdr->camera[6];
+	if (!checkSceneBVH(path, nodes, hdr->numNodes, prims, n, ids, soa[3], soaSize, tris, hdr->numTris, out))
+		return false;
+
+	accel.simd = bestSimdLevel();
+	accel.nodes.assign(nodes, nodes + hdr->numNodes);
+	accel.prims.assign(prims, prims + n);
+	accel.soa.cx.assign(soa[0], soa[0] + soaSize);
+	accel.soa.cy.assign(soa[1], soa[1] + soaSize);
+	accel.soa.cz.assign(soa[2], soa[2] + soaSize);
+	accel.soa.r2.assign(soa[3], soa[3] + soaSize);
+	accel.soa.ids.assign(ids, ids + soaSize);
+	accel.tris.assign(tris, tris + hdr->numTris);
+	accel.meshes = out.meshes.data();
+	return true;
+}
+
+// Loads a text or binary scene from path into out, leaving accel built for it
+bool loadScene(const char *path, Scene &out, BVH &accel) {
+	std::shared_ptr<MappedFile> file(new MappedFile);
+	if (!file->open(path)) {
+		fprintf(stderr, "Cannot read scene %s\n", path);
+		return false;
+	}
+	if (file->size >= sizeof(sceneMagic) && !memcmp(file->data, sceneMagic, sizeof(sceneMagic)))
+		return loadSceneBinary(path, file, out, accel);
+
+	std::string text((const char *)file->data, file->size);
+	if (!parseScene(path, text.c_str(), out)) return false;
+	buildBVH(out, accel);
+	return checkBVHDepth(path, accel.nodes.data(), uint32_t(accel.nodes.size()));
+}
+
+// Points the renderer's globals at scene and collects its lights
+void useScene() {
+	spheres = scene.spheres.data();
+	numSpheres = int(scene.spheres.size());
+	meshes = scene.meshes.data();
+	numMeshes = int(scene.meshes.size());
+	cam = scene.camera;
+	lights.build(spheres, numSpheres);
+}
+
+
+/*
+* Render statistics
+*
+* Each thread counts into its own cache-line aligned RenderStats, and the
+* copies are only summed when a report is written. Building with
+* -DSIMPLEPT_NO_STATS compiles the counters out; -DSIMPLEPT_PHASE_TIMERS
+* adds per-phase tick counts (rdtsc on x86, omp_get_wtime() elsewhere).
+*/
+
+enum Phase { PHASE_INTERSECT, PHASE_SHADOW, PHASE_LIGHT, PHASE_BRDF, PHASE_COUNT };
+
+const char *phaseName(int p) {
+	static const char *names[PHASE_COUNT] = { "intersect", "shadow", "light", "brdf" };
+	return names[p];
+}
+
+struct alignas(64) RenderStats {
+	enum { lengthBins = 33 };   // paths of 0 to 31 vertices, then 32 or more
+
+	RenderStats() { reset(); }
+	void reset() { memset(this, 0, sizeof(*this)); }
+
+	void add(const RenderStats &s) {
+		cameraRays += s.cameraRays;
+		closestRays += s.closestRays;
+		shadowRays += s.shadowRays;
+		for (int k = 0; k < lengthBins; ++k) pathLength[k] += s.pathLength[k];
+		for (int k = 0; k < PHASE_COUNT; ++k) phaseTicks[k] += s.phaseTicks[k];
+	}
+
+	uint64_t cameraRays;        // primary rays
+	uint64_t closestRays;       // closest-hit queries, camera rays included
+	uint64_t shadowRays;        // any-hit queries
+	uint64_t pathLength[lengthBins];   // finished paths by number of vertices
+	uint64_t phaseTicks[PHASE_COUNT];
+};
+
+std::vector<RenderStats *> threadStats;   // every thread's counters so far
+double statsStart = 0;                    // omp_get_wtime() at resetStats()
+uint64_t statsStartTicks = 0;
+
+// The calling thread's counters, registered on first use
+inline RenderStats &localStats() {
+	static thread_local RenderStats *local = 0;
+	if (!local) {
+		local = new RenderStats;
+#pragma omp critical(renderStats)
+		threadStats.push_back(local);
+	}
+	return *local;
+}
+
+inline uint64_t readTicks() {
+#ifdef SIMPLEPT_X86_SIMD
+	return __rdtsc();
+#else
+	return uint64_t(omp_get_wtime() * 1e9);
+#endif
+}
+
+#ifndef SIMPLEPT_NO_STATS
+#define STAT_ADD(field, n) (localStats().field += (n))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#endif
+
+#if defined(SIMPLEPT_PHASE_TIMERS) && !defined(SIMPLEPT_NO_STATS)
+// Adds the ticks between construction and destruction to a phase
+struct PhaseTimer {
+	explicit PhaseTimer(int phase_) : phase(phase_), start(readTicks()) {}
+	~PhaseTimer() { localStats().phaseTicks[phase] += readTicks() - start; }
+
+	int phase;
+	uint64_t start;
+};
+#define PHASE_TIMER(p) PhaseTimer phaseTimer(p)
+#else
+#define PHASE_TIMER(p) ((void)0)
+#endif
+
+inline void countPath(int vertices) {
+	(void)vertices;   // unused with SIMPLEPT_NO_STATS
+	STAT_ADD(pathLength[std::min(vertices, int(RenderStats::lengthBins) - 1)], 1);
+}
+
+// Call only while no thread is rendering
+void resetStats() {
+	for (size_t k = 0; k < threadStats.size(); ++k) threadStats[k]->reset();
+	statsStart = omp_get_wtime();
+	statsStartTicks = readTicks();
+}
+
+RenderStats totalStats() {
+	RenderStats sum;
+	for (size_t k = 0; k < threadStats.size(); ++k) sum.add(*threadStats[k]);
+	return sum;
+}
+
+// Writes the counts since resetStats() as JSON to path, "-" for stdout.
+// Phase times are summed over threads.
+bool writeStats(const char *path, int w, int h, double spp) {
+	const RenderStats s = totalStats();
+	const double seconds = omp_get_wtime() - statsStart;
+	const double tickRate = (readTicks() - statsStartTicks) / std::max(seconds, 1e-9);
+	const uint64_t rays = s.closestRays + s.shadowRays;
+	uint64_t paths = 0;
+	for (int k = 0; k < RenderStats::lengthBins; ++k) paths += s.pathLength[k];
+
+	FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if (!f) return false;
+	fprintf(f, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"spp\": %.2f,\n  \"threads\": %d,\n  \"seconds\": %.6f,\n",
+		w, h, spp, omp_get_max_threads(), seconds);
+	fprintf(f, "  \"rays\": { \"primary\": %llu, \"secondary\": %llu, \"shadow\": %llu, \"total\": %llu, "
+		"\"per_second\": %.0f },\n", (unsigned long long)s.cameraRays,
+		(unsigned long long)(s.closestRays - s.cameraRays), (unsigned long long)s.shadowRays,
+		(unsigned long long)rays, rays / std::max(seconds, 1e-9));
+	fprintf(f, "  \"paths\": %llu,\n  \"path_length\": [", (unsigned long long)paths);
+	for (int k = 0; k < RenderStats::lengthBins; ++k)
+		fprintf(f, "%s%llu", k ? ", " : "", (unsigned long long)s.pathLength[k]);
+	fprintf(f, "]");
+#ifdef SIMPLEPT_PHASE_TIMERS
+	fprintf(f, ",\n  \"phase_seconds\": {");
+	for (int p = 0; p < PHASE_COUNT; ++p)
+		fprintf(f, "%s \"%s\": %.6f", p ? "," : "", phaseName(p), s.phaseTicks[p] / tickRate);
+	fprintf(f, " }");
+#else
+	(void)tickRate;
+#endif
+	fprintf(f, "\n}\n");
+	return f == stdout ? fflush(f) == 0 : fclose(f) == 0;
+}
+
+
+/*
+* NUMA placement
+*
+* --bind pins OpenMP thread t to one CPU, either filling NUMA nodes in turn
+* (close) or dealing threads round-robin over the nodes (spread). Threads
+* then stay on their node, so the film pages each first writes (see
+* Film::clear()) stay local to it. --replicate also gives every node its own
+* copy of the BVH, made by a thread of that node; intersect() and
+* occluded() use the copy of the calling thread's node. Node CPU lists come
+* from sysfs, so both are Linux only. Mesh vertex data stays mapped once.
+*/
+
+enum ThreadBinding { BIND_NONE, BIND_CLOSE, BIND_SPREAD };
+
+struct NumaSettings {
+	int bind;           // a ThreadBinding; BIND_NONE leaves it to the OS and OMP_PROC_BIND
+	bool replicate;
+
+	NumaSettings() : bind(BIND_NONE), replicate(false) {}
+} numa;
+
+// What bindThreads() and replicateScene() last did
+struct NumaState {
+	int bind;
+	std::vector<int> threadNode;    // per OpenMP thread, while bound
+	int nodes;
+	std::vector<std::unique_ptr<BVH> > replicas;   // only ever grows, so threads' pointers stay valid
+
+	NumaState() : bind(BIND_NONE), nodes(1) {}
+} numaState;
+
+thread_local const BVH *threadBVH = 0;   // this thread's replica, or null for bvh
+
+inline const BVH &localBVH() { return threadBVH ? *threadBVH : bvh; }
+
+#ifdef __linux__
+// CPUs of each NUMA node that this process may run on
+std::vector<std::vector<int> > numaNodes() {
+	std::vector<std::vector<int> > nodes;
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) return nodes;
+	for (int node = 0; ; ++node) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (!f) break;
+		std::vector<int> cpus;
+		int lo, hi;
+		while (fscanf(f, "%d", &lo) == 1) {
+			hi = lo;
+			if (fscanf(f, "-%d", &hi) < 0) hi = lo;
+			for (int c = lo; c <= hi; ++c)
+				if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) cpus.push_back(c);
+			if (fgetc(f) != ',') break;
+		}
+		fclose(f);
+		if (!cpus.empty()) nodes.push_back(cpus);
+	}
+	if (nodes.empty()) {   // no sysfs: one node of every allowed CPU
+		nodes.resize(1);
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+			if (CPU_ISSET(c, &allowed)) nodes[0].push_back(c);
+	}
+	return nodes;
+}
+#endif
+
+// Pins the OpenMP threads as numa.bind asks, if it has changed since the
+// last call. Threads keep their pinning when a later binding is BIND_NONE.
+void bindThreads() {
+	const int nthreads = omp_get_max_threads();
+	if (numa.bind == numaState.bind && (numa.bind == BIND_NONE || int(numaState.threadNode.size()) == nthreads))
+		return;
+	numaState.bind = numa.bind;
+	numaState.threadNode.clear();
+	numaState.nodes = 1;
+	if (numa.bind == BIND_NONE) return;
+#ifdef __linux__
+	const std::vector<std::vector<int> > nodes = numaNodes();
+	if (nodes.empty()) {
+		fprintf(stderr, "--bind: cannot read this process's CPUs\n");
+		return;
+	}
+	std::vector<int> cpuOf(nthreads);
+	numaState.threadNode.resize(nthreads);
+	size_t cpus = 0;
+	for (size_t k = 0; k < nodes.size(); ++k) cpus += nodes[k].size();
+	for (int t = 0; t < nthreads; ++t) {
+		int node = 0, k = 0;
+		if (numa.bind == BIND_SPREAD) {
+			node = t % int(nodes.size());
+			k = t / int(nodes.size());
+		}
+		else
+			for (k = int(t % cpus); k >= int(nodes[node].size()); k -= int(nodes[node++].size())) {}
+		numaState.threadNode[t] = node;
+		cpuOf[t] = nodes[node][k % nodes[node].size()];
+	}
+	numaState.nodes = int(nodes.size());
+#pragma omp parallel num_threads(nthreads)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpuOf[omp_get_thread_num()], &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	fprintf(stderr, "Bound %d threads to %d NUMA node%s (%s)\n", nthreads, numaState.nodes,
+		numaState.nodes > 1 ? "s" : "", numa.bind == BIND_SPREAD ? "spread" : "close");
+#else
+	fprintf(stderr, "--bind is only supported on Linux\n");
+#endif
+}
+
+// Copies the BVH to every node the threads are bound to, if numa.replicate
+// is set, and points each thread at its node's copy; otherwise all threads
+// use bvh. prepareCaches() calls this, so it runs before every render.
+void replicateScene() {
+	const int nthreads = omp_get_max_threads();
+	const bool replicate = numa.replicate && numaState.nodes > 1 &&
+		int(numaState.threadNode.size()) == nthreads;
+	if (numa.replicate && !replicate) fprintf(stderr, "--replicate: threads are not bound to several nodes\n");
+	while (replicate && int(numaState.replicas.size()) < numaState.nodes)
+		numaState.replicas.push_back(std::unique_ptr<BVH>(new BVH));
+	const double t0 = omp_get_wtime();
+
+#pragma omp parallel num_threads(nthreads)
+	{
+		const int t = omp_get_thread_num();
+		threadBVH = 0;
+		if (replicate) {
+			const int node = numaState.threadNode[t];
+			// the node's first thread makes its copy, so its pages are local
+			if (std::find(numaState.threadNode.begin(), numaState.threadNode.end(), node) -
+				numaState.threadNode.begin() == t)
+				*numaState.replicas[node] = bvh;
+#pragma omp barrier
+			threadBVH = numaState.replicas[node].get();
+		}
+	}
+	if (replicate)
+		fprintf(stderr, "Replicated the BVH on %d nodes in %.3f s\n", numaState.nodes, omp_get_wtime() - t0);
+}
+
+
+/*
+* Global functions
+*/
+
+// Brute-force closest hit, kept as the reference for the BVH benchmark
+bool intersectLinear(const Sphere *s, int n, const Ray &r, double &t, int &id) {
+	double d, inf = t = 1e20;
+	for (int i = n; i--;) if ((d = s[i].intersect(r)) && d<t) { t = d; id = i; }
+	return t<inf;
+}
+
+bool intersect(const Ray &r, double &t, int &id) {
+	STAT_ADD(closestRays, 1);
+	PHASE_TIMER(PHASE_INTERSECT);
+	return localBVH().intersect(r, t, id);
+}
+
+// Primitive ids, as intersect() returns them, number the spheres first and
+// then the triangles of each mesh in turn
+inline const Mesh &meshOf(int id) {
+	return std::upper_bound(meshes, meshes + numMeshes, id,
+		[](int i, const Mesh &m) { return i < m.firstId; })[-1];
+}
+
+inline const BRDF &primitiveBRDF(int id) {
+	return id < numSpheres ? spheres[id].brdf : *meshOf(id).brdf;
+}
+
+// Only spheres emit
+inline Vec primitiveEmission(int id) {
+	return id < numSpheres ? spheres[id].e : Vec();
+}
+
+// Unit geometric normal at the point x on primitive id, facing either side
+inline Vec primitiveNormal(int id, const Vec &x) {
+	if (id < numSpheres) return (x - spheres[id].p).normalize();
+	const Mesh &m = meshOf(id);
+	return m.normal(id - m.firstId);
+}
+
+// Index of primitive id in lights, -1 if it does not emit
+inline int lightIndex(int id) {
+	return id < numSpheres ? lights.index[id] : -1;
+}
+
+// Shadow ray query: is anything hit along origin + t*dir for t in [eps, tmax)?
+// dir must be normalized.
+bool occluded(const Vec &origin, const Vec &dir, double tmax) {
+	STAT_ADD(shadowRays, 1);
+	PHASE_TIMER(PHASE_SHADOW);
+	return localBVH().occluded(Ray(origin, dir), tmax);
+}
+
+void luminaireSample(const Sphere &source, Vec &surfacePoint, Vec &n, Real &pdf, Sampler &sampler) {
+	double e1, e2;
+	sampler.get2D(e1, e2);
+	Real r = source.rad,
+		z = 2.0 * e1 - 1.0,
+		x = sqrt(1.0 - (z * z)) * cos(2.0 * PI * e2),
+		y = sqrt(1.0 - (z * z)) * sin(2.0 * PI * e2);
+
+	surfacePoint = source.p + (Vec(x, y, z) * r);
+	n = Vec(x, y, z);
+	pdf = 1 / (4.0 * PI * (r * r));
+}
+
+// Samples the cone of directions from x subtended by the light, so every
+// sample lands on the visible cap. pdf is with respect to solid angle.
+// Returns false if x is inside the light (no cone to sample).
+bool luminaireSampleCone(const Sphere &source, const Vec &x, Vec &surfacePoint, Vec &n, Real &pdf, Sampler &sampler) {
+	Vec toCenter = source.p - x;
+	Real dc2 = toCenter.dot(toCenter), r2 = source.rad * source.rad;
+	if (dc2 <= r2 * (1 + 1e-6)) return false;
+
+	double e1, e2;
+	sampler.get2D(e1, e2);
+	Real dc = std::sqrt(dc2),
+		sin2Max = r2 / dc2,
+		cosMax = std::sqrt(std::max<Real>(0, 1 - sin2Max)),
+		cosTheta = 1.0 - e1 * (1.0 - cosMax),
+		sin2Theta = std::max<Real>(0, 1 - cosTheta * cosTheta),
+		phi = 2.0 * PI * e2;
+
+	// distance to the near intersection of the sampled direction with the sphere
+	Real ds = dc * cosTheta - std::sqrt(std::max<Real>(0, r2 - dc2 * sin2Theta));
+
+	Frame f(toCenter * (1.0 / dc));
+	Real sinTheta = std::sqrt(sin2Theta);
+	Vec d = f.toWorld(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+
+	surfacePoint = x + d * ds;
+	n = (surfacePoint - source.p) * (1.0 / source.rad);
+	pdf = 1.0 / (2.0 * PI * (1.0 - cosMax));
+	return true;
+}
+
+
+// Single precision puts hit points up to ~1e-5 off the 1e5-radius walls and
+// light samples ~1e-4 off the light, enough for rays to hit the surface
+// they start on or the light they aim at. fp32 builds move ray origins off
+// the surface by spawnOffset and end shadow rays shadowGap short of the light.
+#ifdef SIMPLEPT_FP32
+const Real spawnOffset = 1e-3f, shadowGap = 1e-2f;
+#else
+const Real spawnOffset = 0, shadowGap = 1e-4;
+#endif
+
+// Origin for rays leaving the surface point x with normal n, n facing the
+// side they leave on
+inline Vec spawnOrigin(const Vec &x, const Vec &n) {
+	return spawnOffset > 0 ? x + n * spawnOffset : x;
+}
+
+double isVisibile(const Vec& x, const Vec&y) {
+	Vec d = y - x;
+	double dist = std::sqrt(d.dot(d));
+
+	// stop just short of y so the surface y lies on does not count as a blocker
+	return occluded(x, d * (1.0 / dist), dist - 1e-4) ? 0.0 : 1.0;
+}
+
+/*
+* KEY FUNCTION: radiance estimator
+*/
+
+enum LightSampling { LIGHT_AREA, LIGHT_CONE };
+
+enum DeviceType { DEVICE_CPU, DEVICE_GPU };
+
+const char *lightSamplingName(int s) {
+	return s == LIGHT_CONE ? "cone" : "area";
+}
+
+struct RenderSettings {
+	int maxDepth;   // hard cap on path vertices, camera vertex is depth 1
+	int rrDepth;    // first depth at which Russian roulette may stop a path
+	bool wavefront; // use the stream renderer instead of one path per sample
+	uint64_t seed;  // base seed of every per-sample generator
+	int sampler;    // SamplerType
+	int lightSampling;  // LightSampling strategy for next-event estimation
+	int lightSelect;    // LightSelect strategy for choosing among emitters
+	bool mis;           // combine light and BRDF sampling with the power heuristic
+	int tileSize;       // edge of the square tiles handed to threads, in pixels
+	double timeBudget;  // progressive mode: stop before a pass would run past this many seconds
+	double noiseTarget; // progressive mode: stop once the estimated RMSE (8-bit units) is below this
+	double adaptiveError;   // progressive mode: sample only pixels with a larger relative error
+	double cacheCell;   // radiance cache cell edge in scene units, 0 to trace every path in full
+	int causticPhotons;     // photons emitted for the caustic map, 0 for none
+	double causticRadius;   // caustic map gather radius in scene units
+	int device;         // DeviceType passes run on
+	bool spectral;      // trace hero wavelengths instead of RGB
+
+	RenderSettings() : maxDepth(64), rrDepth(5), wavefront(false), seed(0), sampler(SAMPLER_INDEPENDENT),
+		lightSampling(LIGHT_AREA), lightSelect(LIGHTS_POWER), mis(false), tileSize(16),
+		timeBudget(0), noiseTarget(0), adaptiveError(0), cacheCell(0), causticPhotons(0), causticRadius(2),
+		device(DEVICE_CPU), spectral(false) {}
+} settings;
+
+// This process's share of a frame rendered by several (--tiles, --first-sample)
+struct ClusterSettings {
+	int part, parts;    // render only the tiles whose row-major index is part mod parts
+	int firstSample;    // per subpixel; this process's samples start here in every pixel's sequence
+
+	ClusterSettings() : part(0), parts(1), firstSample(0) {}
+} cluster;
+
+inline Real powerHeuristic(Real a, Real b) {
+	return a * a / (a * a + b * b);
+}
+
+// Solid-angle pdf with which sampleDirect() at x produces the point y (with
+// normal ny) on emitter `id`, light choice included
+Real lightPdf(int id, const Vec &x, const Vec &y, const Vec &ny) {
+	const Sphere &light = spheres[id];
+	Real pick = lights.pdf(settings.lightSelect, x, lights.index[id]);
+	if (settings.lightSampling == LIGHT_CONE) {
+		Real dc2 = (light.p - x).dot(light.p - x), r2 = light.rad * light.rad;
+		if (dc2 > r2 * (1 + 1e-6))
+			return pick / (2.0 * PI * (1.0 - std::sqrt(std::max(0.0, 1.0 - r2 / dc2))));
+	}
+	Vec d = y - x;
+	Real dist2 = d.dot(d), cosLight = std::abs(ny.dot(d)) / std::sqrt(dist2);
+	return cosLight > 0 ? pick * dist2 / (cosLight * 4.0 * PI * light.rad * light.rad) : 0;
+}
+
+// Next-event estimation at r.o: picks a point on a light and returns which
+// sphere it is, the shadow ray to test (origin r.o, direction dir, length
+// tmax), cos / pdf at r.o and the MIS weight (1 without --mis), so that the
+// contribution if unoccluded is light.e * BRDF * scale * weight. Returns
+// false when no shadow ray is needed because the contribution is zero.
+// r.o lies on primitive id, whose BRDF must not be specular; f is the
+// shading frame at r.o.
+bool sampleLight(int id, const BRDF &brdf, const Ray &r, const Frame &f, int &light, Vec &dir, Real &tmax,
+	Real &scale, Real &weight, Sampler &sampler) {
+	PHASE_TIMER(PHASE_LIGHT);
+	Vec y1;				//surface point on light source
+	Vec sourceNormal;	//normal at surface point
+	Real pdf1;			//pdf of light source, per unit solid angle
+
+	// one light per shading point, weighted by its selection probability
+	int li;
+	double pickPdf;
+	if (!lights.sample(settings.lightSelect, r.o, sampler.get1D(), li, pickPdf)) return false;
+	if (lights.ids[li] == id) return false;
+	light = lights.ids[li];
+	const Sphere &emitter = spheres[light];
+
+	Real dist;
+	if (settings.lightSampling == LIGHT_CONE &&
+		luminaireSampleCone(emitter, r.o, y1, sourceNormal, pdf1, sampler)) {
+		dist = std::sqrt((y1 - r.o).dot(y1 - r.o));
+		dir = (y1 - r.o) * (1.0 / dist);
+	}
+	else {
+		luminaireSample(emitter, y1, sourceNormal, pdf1, sampler);
+		Real r2 = (r.o - y1).dot(r.o - y1);
+		dist = std::sqrt(r2);
+		dir = (y1 - r.o) * (1.0 / dist);
+
+		// points on the far side of the light contribute nothing; skip their shadow ray
+		Real cosLight = sourceNormal.dot(dir * -1);
+		if (cosLight <= 0) return false;
+		pdf1 *= r2 / cosLight;
+	}
+	pdf1 *= pickPdf;
+
+	Real cosSurf = f.n.dot(dir);
+	if (cosSurf <= 0) return false;
+
+	scale = cosSurf / pdf1;
+	weight = settings.mis ? powerHeuristic(pdf1, brdf.pdf(f, r.d, dir)) : 1;
+	tmax = dist - shadowGap;
+	return true;
+}
+
+// sampleLight() with the contribution, in RGB
+bool sampleDirect(int id, const BRDF &brdf, const Ray &r, const Frame &f, Vec &contrib, Vec &dir, Real &tmax,
+	Sampler &sampler) {
+	int light;
+	Real scale, weight;
+	if (!sampleLight(id, brdf, r, f, light, dir, tmax, scale, weight, sampler)) return false;
+	contrib = spheres[light].e.mult(brdf.eval(f, dir, r.d)) * scale;
+	if (settings.mis) contrib = contrib * weight;
+	return true;
+}
+
+// MIS weight of emission found by a BRDF sample taken at prevX with
+// solid-angle pdf brdfPdf, hitting emitter `id` at x with normal n
+Real emissionWeight(const Vec &prevX, Real brdfPdf, int id, const Vec &x, const Vec &n) {
+	return powerHeuristic(brdfPdf, lightPdf(id, prevX, x, n));
+}
+
+Vec directRadiance(int id, const BRDF &brdf, const Ray &r, const Frame &f, Sampler &sampler) {
+	Vec contrib, dir;
+	Real tmax;
+	if (sampleDirect(id, brdf, r, f, contrib, dir, tmax, sampler) && !occluded(r.o, dir, tmax))
+		return contrib;
+	return Vec();
+}
+
+// Sample dimensions: the pixel filter uses 0-1, then each bounce gets six,
+// at bounceDimension(depth) + DIM_LIGHT (light choice and point on it),
+// DIM_RR (roulette) and DIM_BRDF (BRDF sample)
+enum { DIM_FILTER = 0, DIM_LIGHT = 0, DIM_RR = 3, DIM_BRDF = 4 };
+
+inline int bounceDimension(int depth) {
+	return 2 + 6 * (depth - 1);
+}
+
+// Radiance cache (--cache S): diffuse outgoing radiance divided by the
+// surface reflectance, summed in a hash grid keyed on the S-sized cell a
+// point falls in and the major axis of its normal. Every path adds what it
+// gathered beyond each of its first diffuse vertices; a path reaching a
+// diffuse surface after its first diffuse bounce takes the cell's mean
+// instead of going on, once the cell has minSamples. Cells stop taking
+// samples at maxSamples, which also ends contention on them. The cache is
+// biased towards the cell mean and filled in whatever order threads run,
+// so it is meant for previews.
+inline void atomicAdd(std::atomic<float> &a, float v) {
+	float old = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {}
+}
+
+struct RadianceCache {
+	enum { tableBits = 19, probes = 8, minSamples = 16, maxSamples = 1024 };
+
+	struct Entry {
+		std::atomic<uint64_t> key;   // 0 while empty
+		std::atomic<uint32_t> count;
+		std::atomic<float> sum[3];
+	};
+
+	RadianceCache() : cell(0) {}
+
+	// Empties the cache, or frees it when cell is 0
+	void reset(double cell_) {
+		cell = cell_;
+		std::vector<Entry> t(cell > 0 ? size_t(1) << tableBits : 0);
+		table.swap(t);
+	}
+
+	uint64_t key(const Vec &x, const Vec &n) const {
+		const double inv = 1 / cell;
+		const uint64_t cx = uint64_t(int64_t(std::floor(x.x * inv))) & 0xfffff;
+		const uint64_t cy = uint64_t(int64_t(std::floor(x.y * inv))) & 0xfffff;
+		const uint64_t cz = uint64_t(int64_t(std::floor(x.z * inv))) & 0xfffff;
+		const double ax = std::abs(n.x), ay = std::abs(n.y), az = std::abs(n.z);
+		const int axis = ax >= ay && ax >= az ? 0 : ay >= az ? 1 : 2;
+		const double major = axis == 0 ? n.x : axis == 1 ? n.y : n.z;
+		const uint64_t dir = 2 * axis + (major < 0);
+		return 1ull << 63 | dir << 60 | cz << 40 | cy << 20 | cx;
+	}
+
+	// Entry of key, claiming an empty one if insert is set; null if the key
+	// is absent or its probe sequence is full
+	Entry *find(uint64_t key, bool insert) {
+		const size_t mask = table.size() - 1;
+		size_t slot = size_t((key * 0x9e3779b97f4a7c15ull) >> (64 - tableBits));
+		for (int p = 0; p < probes; ++p, slot = (slot + 1) & mask) {
+			Entry &e = table[slot];
+			uint64_t k = e.key.load(std::memory_order_acquire);
+			if (k == key) return &e;
+			if (k) continue;
+			if (!insert) return 0;
+			if (e.key.compare_exchange_strong(k, key, std::memory_order_acq_rel) || k == key) return &e;
+		}
+		return 0;
+	}
+
+	bool lookup(uint64_t key, Vec &value) {
+		const Entry *e = find(key, false);
+		const uint32_t n = e ? e->count.load(std::memory_order_relaxed) : 0;
+		if (n < minSamples) return false;
+		value = Vec(e->sum[0].load(std::memory_order_relaxed), e->sum[1].load(std::memory_order_relaxed),
+			e->sum[2].load(std::memory_order_relaxed)) * (1.0 / n);
+		return true;
+	}
+
+	void add(uint64_t key, const Vec &value) {
+		Entry *e = find(key, true);
+		if (!e || e->count.load(std::memory_order_relaxed) >= maxSamples) return;
+		atomicAdd(e->sum[0], float(value.x));
+		atomicAdd(e->sum[1], float(value.y));
+		atomicAdd(e->sum[2], float(value.z));
+		e->count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::vector<Entry> table;
+	double cell;    // 0 when off
+} radianceCache;
+
+// Diffuse vertices of one path waiting for the radiance found beyond them
+struct CachePath {
+	enum { maxVertices = 3 };
+
+	CachePath() : count(0), diffuse(0) {}
+
+	// At a diffuse vertex with reflectance k and throughput beta, once its
+	// emission is in L: ends the path with the cached radiance (returning
+	// true), or records the vertex
+	bool visit(const Vec &x, const Vec &n, const Vec &k, const Vec &beta, Vec &L) {
+		const uint64_t key = radianceCache.key(x, n);
+		Vec value;
+		if (diffuse++ && radianceCache.lookup(key, value)) {
+			L = L + beta.mult(k).mult(value);
+			return true;
+		}
+		if (count == maxVertices) return false;
+		const Vec w = beta.mult(k);
+		keys[count] = key;
+		scale[count] = Vec(w.x > 0 ? 1 / w.x : 0, w.y > 0 ? 1 / w.y : 0, w.z > 0 ? 1 / w.z : 0);
+		before[count] = L;
+		++count;
+		return false;
+	}
+
+	// Adds the recorded vertices to the cache, L being the path's total
+	void finish(const Vec &L) {
+		for (int v = 0; v < count; ++v) radianceCache.add(keys[v], (L - before[v]).mult(scale[v]));
+		count = diffuse = 0;
+	}
+
+	uint64_t keys[maxVertices];
+	Vec scale[maxVertices];   // 1 / (beta * k) at the vertex
+	Vec before[maxVertices];  // path radiance before the vertex's direct light
+	int count, diffuse;
+};
+
+// Caustic photon map (--caustics N): before rendering, N photons leave the
+// lights (picked by power, uniform over the sphere, cosine-weighted) and
+// follow specular bounces; those reaching a diffuse surface after at least
+// one are stored. A hash grid of 2r cells, built by a parallel counting
+// sort, holds them in bucket order, so a gather within r reads at most
+// eight contiguous runs. Paths then add the photon estimate at every
+// diffuse vertex and skip emission reached through specular bounces after
+// one, which is the light the map already holds. Only the first
+// gatherVertices diffuse vertices of a path gather; past them caustics are
+// left to the path tracer, as they are faint and gathers are not free.
+struct CausticMap {
+	enum { gatherVertices = 2 };
+
+	struct Photon {
+		float p[3], power[3], n[3];
+	};
+
+	CausticMap() : radius(0), cell(0), bits(0) {}
+
+	void build(int emitted, double radius);
+	bool empty() const { return photons.empty(); }
+
+	// Whether the last of a path's first `diffuse` diffuse vertices gathered
+	bool gathered(int diffuse) const { return diffuse > 0 && diffuse <= gatherVertices && !photons.empty(); }
+
+	// Caustic irradiance at x on a surface with normal n
+	Vec irradiance(const Vec &x, const Vec &n) const;
+
+	uint32_t bucket(int64_t cx, int64_t cy, int64_t cz) const {
+		uint64_t h = (uint64_t(cx) * 0x9e3779b97f4a7c15ull ^ uint64_t(cy) * 0xc2b2ae3d27d4eb4full ^
+			uint64_t(cz) * 0x165667b19e3779f9ull) * 0xff51afd7ed558ccdull;
+		return uint32_t(h >> (64 - bits));
+	}
+
+	int64_t cellOf(double v) const { return int64_t(std::floor(v / cell)); }
+
+	std::vector<Photon> photons;   // grouped by bucket
+	std::vector<uint32_t> start;   // first photon of each bucket, then photons.size()
+	AABB bounds;                   // of the photons, grown by radius
+	double radius, cell;
+	int bits;                      // log2 of the bucket count
+} caustics;
+
+// Traces photon k of emitted, appending it to out if it lands as a caustic
+void tracePhoton(int k, int emitted, Sampler &sampler, std::vector<CausticMap::Photon> &out) {
+	sampler.startSample(0, 0, 0, k);
+	sampler.setDimension(0);
+	int light;
+	double pick, u1, u2;
+	if (!lights.sample(LIGHTS_POWER, Vec(), sampler.get1D(), light, pick)) return;
+	const Sphere &s = spheres[lights.ids[light]];
+	sampler.setDimension(2);
+	sampler.get2D(u1, u2);
+	const double z = 1 - 2 * u1, r = std::sqrt(std::max(0.0, 1 - z * z)), phi = 2 * PI * u2;
+	const Vec n(r * std::cos(phi), r * std::sin(phi), z);
+	Vec d;
+	Real pdf;
+	sampler.setDimension(4);
+	uniformRandomPSA(Frame(n), Vec(), d, pdf, sampler);
+	// emitted flux pi * A * Le, shared by the photons that pick this light
+	Vec power = s.e * (PI * 4 * PI * s.rad * s.rad / (pick * emitted));
+	Ray ray(spawnOrigin(s.p + n * s.rad, n), d);
+
+	for (int depth = 1; depth < settings.maxDepth; ++depth) {
+		double t;
+		int id = 0;
+		if (!intersect(ray, t, id)) return;
+		const Vec x = ray.o + ray.d * t, o = Vec() - ray.d;
+		Vec nx = primitiveNormal(id, x);
+		if (nx.dot(o) < 0) nx = nx * -1.0;
+		const BRDF &brdf = primitiveBRDF(id);
+		if (!brdf.isSpecular()) {
+			if (depth > 1) {
+				CausticMap::Photon p = { { float(x.x), float(x.y), float(x.z) },
+					{ float(power.x), float(power.y), float(power.z) }, { float(nx.x), float(nx.y), float(nx.z) } };
+				out.push_back(p);
+			}
+			return;
+		}
+		const Frame frame(nx);
+		Vec i;
+		brdf.sample(frame, o, i, pdf, sampler);
+		if (pdf <= 0) return;
+		power = power.mult(brdf.eval(frame, o, i)) * (nx.dot(i) / pdf);
+		ray = Ray(spawnOrigin(x, nx), i);
+	}
+}
+
+void CausticMap::build(int emitted, double radius_) {
+	photons.clear();
+	start.clear();
+	radius = radius_;
+	cell = 2 * radius;
+	if (emitted <= 0 || lights.size() == 0) return;
+
+	// Photons in emission order: static chunks concatenated by thread
+	std::vector<std::vector<Photon> > found(omp_get_max_threads());
+#pragma omp parallel
+	{
+		Sampler sampler(SAMPLER_SOBOL, mix64(settings.seed ^ 0x70686f746f6e73ull));
+		std::vector<Photon> &mine = found[omp_get_thread_num()];
+#pragma omp for schedule(static)
+		for (int k = 0; k < emitted; ++k) tracePhoton(k, emitted, sampler, mine);
+	}
+	std::vector<Photon> all;
+	for (size_t t = 0; t < found.size(); ++t) all.insert(all.end(), found[t].begin(), found[t].end());
+	const int n = int(all.size());
+	if (!n) return;
+	bounds = AABB();
+	for (int i = 0; i < n; ++i) bounds.expand(Vec(all[i].p[0], all[i].p[1], all[i].p[2]));
+	bounds.lo = bounds.lo - Vec(radius, radius, radius);
+	bounds.hi = bounds.hi + Vec(radius, radius, radius);
+
+	// Counting sort by bucket; the scatter is atomic, so each bucket is
+	// sorted back into emission order to keep the map reproducible
+	bits = 1;
+	while ((1 << bits) < 2 * n && bits < 28) ++bits;
+	const size_t buckets = size_t(1) << bits;
+	std::vector<uint32_t> key(n), order(n);
+	std::vector<std::atomic<uint32_t> > count(buckets + 1);
+#pragma omp parallel for
+	for (int i = 0; i < n; ++i) {
+		key[i] = bucket(cellOf(all[i].p[0]), cellOf(all[i].p[1]), cellOf(all[i].p[2]));
+		count[key[i]].fetch_add(1, std::memory_order_relaxed);
+	}
+	start.resize(buckets + 1);
+	uint32_t sum = 0;
+	for (size_t b = 0; b <= buckets; ++b) {
+		start[b] = sum;
+		sum += count[b].load(std::memory_order_relaxed);
+		count[b].store(start[b], std::memory_order_relaxed);
+	}
+#pragma omp parallel for
+	for (int i = 0; i < n; ++i) order[count[key[i]].fetch_add(1, std::memory_order_relaxed)] = uint32_t(i);
+	photons.resize(n);
+#pragma omp parallel for schedule(dynamic, 4096)
+	for (int64_t b = 0; b < int64_t(buckets); ++b) {
+		std::sort(order.begin() + start[b], order.begin() + start[b + 1]);
+		for (uint32_t j = start[b]; j < start[b + 1]; ++j) photons[j] = all[order[j]];
+	}
+}
+
+Vec CausticMap::irradiance(const Vec &x, const Vec &n) const {
+	// most shading points are nowhere near a caustic
+	if (photons.empty() || x.x < bounds.lo.x || x.y < bounds.lo.y || x.z < bounds.lo.z ||
+		x.x > bounds.hi.x || x.y > bounds.hi.y || x.z > bounds.hi.z)
+		return Vec();
+	const double r2 = radius * radius;
+	const int64_t lo[3] = { cellOf(x.x - radius), cellOf(x.y - radius), cellOf(x.z - radius) };
+	uint32_t seen[8];
+	int visited = 0;
+	double sum[3] = { 0, 0, 0 };
+	for (int c = 0; c < 8; ++c) {
+		const uint32_t b = bucket(lo[0] + (c & 1), lo[1] + (c >> 1 & 1), lo[2] + (c >> 2));
+		if (std::find(seen, seen + visited, b) != seen + visited) continue;
+		seen[visited++] = b;
+		for (uint32_t j = start[b]; j < start[b + 1]; ++j) {
+			const Photon &p = photons[j];
+			const double dx = p.p[0] - x.x, dy = p.p[1] - x.y, dz = p.p[2] - x.z;
+			if (dx * dx + dy * dy + dz * dz > r2 || p.n[0] * n.x + p.n[1] * n.y + p.n[2] * n.z < 0.9) continue;
+			for (int k = 0; k < 3; ++k) sum[k] += p.power[k];
+		}
+	}
+	const double inv = 1 / (PI * r2);
+	return Vec(sum[0] * inv, sum[1] * inv, sum[2] * inv);
+}
+
+// Binds threads and replicates the scene as numa asks, empties the radiance
+// cache and rebuilds the caustic map, as settings ask, before a render. Runs
+// before the render's film is allocated, so that its first touch happens on
+// bound threads.
+void prepareCaches() {
+	bindThreads();
+	replicateScene();
+	radianceCache.reset(settings.cacheCell);
+	const double t0 = omp_get_wtime();
+	caustics.build(settings.causticPhotons, settings.causticRadius);
+	if (settings.causticPhotons > 0)
+		fprintf(stderr, "Caustic map: %d of %d photons in %.2f s\n", int(caustics.photons.size()),
+			settings.causticPhotons, omp_get_wtime() - t0);
+}
+
+// Iterative path tracer. Each vertex adds its emission (only when the
+// previous vertex was specular or this is the camera vertex, `flag`), plus
+// direct lighting at diffuse surfaces, then continues along a BRDF sample.
+// `beta` carries the product of BRDF * cos / pdf along the path so far.
+// With --mis, emission reached from a diffuse vertex is also counted, and
+// both it and the direct light sample are weighted by the power heuristic.
+// With the radiance cache on, the path may end at its second diffuse vertex.
+// With a caustic map, diffuse vertices add its estimate instead of finding
+// caustics by chance.
+Vec receivedRadiance(const Ray &r, int depth, bool flag, Sampler &sampler) {
+	Vec L, beta(1, 1, 1);
+	Ray ray = r;
+	Real prevPdf = 0;                               // BRDF pdf of ray.d at ray.o
+	int vertices = 0;
+	CachePath cached;
+	int diffuse = 0;                                // diffuse vertices so far
+
+	for (;; ++depth) {
+		double t;                                   // Distance to intersection
+		int id = 0;                                 // id of intersected primitive
+
+		if (!intersect(ray, t, id)) break;          // if miss, no more light
+		++vertices;
+
+		Vec x = ray.o + ray.d*t;                    // The intersection point
+		Vec o = (Vec() - ray.d).normalize();        // The outgoing direction (= -r.d)
+
+		Vec n = primitiveNormal(id, x);             // The normal direction
+		if (n.dot(o) < 0) n = n*-1.0;
+		x = spawnOrigin(x, n);
+
+		const BRDF &brdf = primitiveBRDF(id);
+		const bool specular = brdf.isSpecular();
+		const Frame frame(n);
+		if (flag) {
+			if (!caustics.gathered(diffuse)) L = L + beta.mult(primitiveEmission(id));
+		}
+		else if (settings.mis && prevPdf > 0 && lightIndex(id) >= 0)
+			L = L + beta.mult(primitiveEmission(id)) * emissionWeight(ray.o, prevPdf, id, x, n);
+		const int dim = bounceDimension(depth);
+		if (!specular && radianceCache.cell > 0 && cached.visit(x, n, brdf.k, beta, L)) break;
+		if (!specular) {
+			Ray out(x, o);
+			sampler.setDimension(dim + DIM_LIGHT);
+			L = L + beta.mult(directRadiance(id, brdf, out, frame, sampler));
+			if (caustics.gathered(++diffuse)) L = L + beta.mult(brdf.k).mult(caustics.irradiance(x, n)) * (1 / PI);
+		}
+
+		if (depth >= settings.maxDepth) break;
+
+		// Russian roulette on the path throughput once the path is long enough
+		Real p = 1.0;
+		if (depth >= settings.rrDepth) {
+			p = std::min<Real>(0.95, std::max(beta.x, std::max(beta.y, beta.z)));
+			sampler.setDimension(dim + DIM_RR);
+			if (p <= 0 || sampler.get1D() >= p) break;
+		}
+
+		//sample a new incoming direction at the surface point
+		Vec i;
+		Real pdf;
+		sampler.setDimension(dim + DIM_BRDF);
+		Vec fr;
+		{
+			PHASE_TIMER(PHASE_BRDF);
+			brdf.sample(frame, o, i, pdf, sampler);
+			if (pdf > 0) fr = brdf.eval(frame, o, i);
+		}
+		if (pdf <= 0) break;
+
+		beta = beta.mult(fr) * (n.dot(i) / (pdf * p));
+		ray = Ray(x, i);
+		flag = specular;
+		prevPdf = specular ? 0 : pdf;
+	}
+
+	countPath(vertices);
+	if (radianceCache.cell > 0) cached.finish(L);
+	return L;
+}
+
+
+/*
+* Spectral rendering
+*
+* --spectral carries radiance at spectralLanes hero wavelengths per path
+* (Wilkie et al. 2014, "Hero Wavelength Spectral Sampling"): one drawn
+* uniformly over [lambdaMin, lambdaMax) and the others evenly rotated from
+* it, held as floats so that each product along the path is one SIMD
+* operation. Scene colours stay RGB and are upsampled per wavelength to
+* three boxes (blue below 490 nm, green below 590 nm, red above) weighted
+* so that the box spectrum maps back to the same RGB. Each path's estimate
+* goes to the film in linear sRGB through the CIE 1931 matching functions
+* (the Wyman et al. 2013 fit), each channel scaled so a flat spectrum is
+* white. BRDFs are not dispersive, so all lanes share one path.
+*/
+
+const int spectralLanes = 4;
+const int lambdaMin = 380, lambdaMax = 720;   // nm
+
+struct alignas(16) Spectrum {
+	float v[spectralLanes];
+
+	explicit Spectrum(float x = 0) { for (int k = 0; k < spectralLanes; ++k) v[k] = x; }
+
+	Spectrum operator+(const Spectrum &b) const {
+		Spectrum r;
+		for (int k = 0; k < spectralLanes; ++k) r.v[k] = v[k] + b.v[k];
+		return r;
+	}
+	Spectrum operator*(const Spectrum &b) const {
+		Spectrum r;
+		for (int k = 0; k < spectralLanes; ++k) r.v[k] = v[k] * b.v[k];
+		return r;
+	}
+	Spectrum operator*(float s) const {
+		Spectrum r;
+		for (int k = 0; k < spectralLanes; ++k) r.v[k] = v[k] * s;
+		return r;
+	}
+	float max() const {
+		float m = v[0];
+		for (int k = 1; k < spectralLanes; ++k) m = std::max(m, v[k]);
+		return m;
+	}
+};
+
+// Colour matching tabulated at 1 nm, and the RGB to box weights
+struct SpectralTables {
+	enum { entries = lambdaMax - lambdaMin + 1 };
+
+	SpectralTables() : bar(entries) {
+		Vec sum;
+		for (int k = 0; k < entries; ++k) {
+			const double l = lambdaMin + k;
+			const double x = 1.056 * lobe(l, 599.8, 37.9, 31.0) + 0.362 * lobe(l, 442.0, 16.0, 26.7) -
+				0.065 * lobe(l, 501.1, 20.4, 26.2);
+			const double y = 0.821 * lobe(l, 568.8, 46.9, 40.5) + 0.286 * lobe(l, 530.9, 16.3, 31.1);
+			const double z = 1.217 * lobe(l, 437.0, 11.8, 36.0) + 0.681 * lobe(l, 459.0, 26.0, 13.8);
+			bar[k] = Vec(3.2406 * x - 1.5372 * y - 0.4986 * z, -0.9689 * x + 1.8758 * y + 0.0415 * z,
+				0.0557 * x - 0.2040 * y + 1.0570 * z);
+			sum = sum + bar[k];
+		}
+		// Each channel integrates to one, and the boxes' RGB are the columns
+		// of a matrix whose inverse takes RGB to box weights
+		double a[3][3] = { { 0 } };
+		for (int k = 0; k < entries; ++k) {
+			bar[k] = Vec(bar[k].x / sum.x, bar[k].y / sum.y, bar[k].z / sum.z);
+			const int b = band(lambdaMin + k);
+			a[0][b] += bar[k].x;
+			a[1][b] += bar[k].y;
+			a[2][b] += bar[k].z;
+		}
+		const double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+			a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+		for (int i = 0; i < 3; ++i)
+			for (int j = 0; j < 3; ++j)   // adjugate, transposed
+				toBox[j][i] = (a[(i + 1) % 3][(j + 1) % 3] * a[(i + 2) % 3][(j + 2) % 3] -
+					a[(i + 1) % 3][(j + 2) % 3] * a[(i + 2) % 3][(j + 1) % 3]) / det;
+	}
+
+	// Piecewise Gaussian of the matching-function fit
+	static double lobe(double l, double mu, double below, double above) {
+		const double t = (l - mu) / (l < mu ? below : above);
+		return std::exp(-0.5 * t * t);
+	}
+
+	// Box of wavelength l: 0 red, 1 green, 2 blue, as RGB components
+	static int band(double l) { return l < 490 ? 2 : l < 590 ? 1 : 0; }
+
+	Vec matching(double l) const {
+		const double u = std::min(std::max(l - lambdaMin, 0.0), double(entries - 1) - 1e-9);
+		const int k = int(u);
+		return bar[k] + (bar[k + 1] - bar[k]) * (u - k);
+	}
+
+	std::vector<Vec> bar;   // normalized RGB matching, per nm from lambdaMin
+	double toBox[3][3];
+} spectralTables;
+
+// The wavelengths of one path
+struct SpectralSample {
+	explicit SpectralSample(double u) {
+		const double range = double(lambdaMax - lambdaMin);
+		for (int k = 0; k < spectralLanes; ++k) {
+			double l = lambdaMin + (u + double(k) / spectralLanes) * range;
+			if (l >= lambdaMax) l -= range;
+			band[k] = SpectralTables::band(l);
+			weight[k] = spectralTables.matching(l) * (range / spectralLanes);
+		}
+	}
+
+	// c as a box spectrum at these wavelengths, negative weights clipped
+	Spectrum upsample(const Vec &c) const {
+		const double (*m)[3] = spectralTables.toBox;
+		float box[3];
+		for (int b = 0; b < 3; ++b)
+			box[b] = float(std::max(0.0, double(m[b][0] * c.x + m[b][1] * c.y + m[b][2] * c.z)));
+		Spectrum s;
+		for (int k = 0; k < spectralLanes; ++k) s.v[k] = box[band[k]];
+		return s;
+	}
+
+	Vec toRGB(const Spectrum &L) const {
+		Vec c;
+		for (int k = 0; k < spectralLanes; ++k) c = c + weight[k] * double(L.v[k]);
+		return c;
+	}
+
+	int band[spectralLanes];
+	Vec weight[spectralLanes];   // RGB per unit radiance at each wavelength
+};
+
+// receivedRadiance() from a camera ray at the hero wavelengths of one
+// sample, without the radiance cache and caustic map; returns the RGB
+// estimate. The wavelength comes from the first dimension past any bounce.
+Vec spectralRadiance(const Ray &r, Sampler &sampler) {
+	sampler.setDimension(bounceDimension(settings.maxDepth + 1));
+	const SpectralSample lambda(sampler.get1D());
+	Spectrum L, beta(1);
+	Ray ray = r;
+	Real prevPdf = 0;
+	bool flag = true;
+	int vertices = 0;
+
+	for (int depth = 1; ; ++depth) {
+		double t;
+		int id = 0;
+		if (!intersect(ray, t, id)) break;
+		++vertices;
+
+		Vec x = ray.o + ray.d*t;
+		Vec o = (Vec() - ray.d).normalize();
+		Vec n = primitiveNormal(id, x);
+		if (n.dot(o) < 0) n = n*-1.0;
+		x = spawnOrigin(x, n);
+
+		const BRDF &brdf = primitiveBRDF(id);
+		const bool specular = brdf.isSpecular();
+		const Frame frame(n);
+		if (flag) L = L + beta * lambda.upsample(primitiveEmission(id));
+		else if (settings.mis && prevPdf > 0 && lightIndex(id) >= 0)
+			L = L + beta * lambda.upsample(primitiveEmission(id)) * float(emissionWeight(ray.o, prevPdf, id, x, n));
+		const int dim = bounceDimension(depth);
+		if (!specular) {
+			int light;
+			Vec dir;
+			Real tmax, scale, weight;
+			sampler.setDimension(dim + DIM_LIGHT);
+			if (sampleLight(id, brdf, Ray(x, o), frame, light, dir, tmax, scale, weight, sampler) &&
+				!occluded(x, dir, tmax))
+				L = L + beta * lambda.upsample(spheres[light].e) * lambda.upsample(brdf.eval(frame, dir, o)) *
+					float(scale * weight);
+		}
+
+		if (depth >= settings.maxDepth) break;
+
+		Real p = 1.0;
+		if (depth >= settings.rrDepth) {
+			p = std::min<Real>(0.95, beta.max());
+			sampler.setDimension(dim + DIM_RR);
+			if (p <= 0 || sampler.get1D() >= p) break;
+		}
+
+		Vec i;
+		Real pdf;
+		sampler.setDimension(dim + DIM_BRDF);
+		Vec fr;
+		{
+			PHASE_TIMER(PHASE_BRDF);
+			brdf.sample(frame, o, i, pdf, sampler);
+			if (pdf > 0) fr = brdf.eval(frame, o, i);
+		}
+		if (pdf <= 0) break;
+
+		beta = beta * lambda.upsample(fr) * float(n.dot(i) / (pdf * p));
+		ray = Ray(x, i);
+		flag = specular;
+		prevPdf = specular ? 0 : pdf;
+	}
+
+	countPath(vertices);
+	return lambda.toRGB(L);
+}
+
+
+/*
+* Image formation
+*/
+
+// Primary ray through subpixel (sx, sy) of pixel (x, y), tent-filtered
+Ray cameraRay(const Vec &cx, const Vec &cy, int w, int h, int x, int y, int sx, int sy, Sampler &sampler) {
+	STAT_ADD(cameraRays, 1);
+	double r1, r2;
+	sampler.setDimension(DIM_FILTER);
+	sampler.get2D(r1, r2);
+	r1 *= 2; r2 *= 2;
+	double dx = r1<1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+	double dy = r2<1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+	Vec d = cx*(((sx + .5 + dx) / 2 + x) / w - .5) +
+		cy*(((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
+	return Ray(cam.o, d.normalize());
+}
+
+// Sample index of the s-th sample of subpixel sub. Each subpixel draws from
+// its own aligned block of the sequence, so a pass continuing where the last
+// stopped extends the same stratified set.
+inline int subpixelSample(int sub, int s) { return (sub << 24) + s; }
+
+// Allocator whose default construction writes nothing, so that a page of a
+// large buffer is placed on the NUMA node of the thread that first writes it
+// rather than of the one that allocated it
+template <class T> struct FirstTouchAllocator : std::allocator<T> {
+	template <class U> struct rebind { typedef FirstTouchAllocator<U> other; };
+
+	FirstTouchAllocator() {}
+	template <class U> FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+	template <class U> void construct(U *) {}
+	template <class U, class... Args> void construct(U *p, Args &&... args) {
+		::new ((void *)p) U(std::forward<Args>(args)...);
+	}
+};
+
+// Running mean and variance (Welford) of one pixel's per-sample luminance
+struct PixelStats {
+	PixelStats() : n(0), mean(0), m2(0) {}
+
+	void add(double x) {
+		++n;
+		double d = x - mean;
+		mean += d / n;
+		m2 += d * (x - mean);
+	}
+
+	// Standard error of the mean relative to the mean; dark pixels are
+	// measured against a floor so they do not soak up samples
+	double relativeError() const {
+		if (n < 2) return 1e30;
+		return std::sqrt(m2 / (double(n) * (n - 1))) / std::max(mean, 1e-2);
+	}
+
+	int n;      // samples per subpixel taken at this pixel
+	double mean, m2;
+};
+
+// Pixel rectangle; y0 is the bottom row, as with the camera's y
+struct Tile {
+	int x0, y0, w, h;
+};
+
+// Unclamped fp32 radiance sums per pixel plus per-pixel statistics, one
+// plane per channel. Rows are padded to whole cache lines, so tiles whose
+// width is a multiple of 16 pixels (the default size) never share a line.
+struct Film {
+	struct alignas(64) Line { float v[16]; };
+	enum { lineFloats = 16 };
+
+	// Planes and stats are left unwritten until clear(), which zeroes each
+	// tile on the thread that renders it first
+	Film(int w_, int h_) : w(w_), h(h_), samples(0), pitch((w_ + lineFloats - 1) / lineFloats * lineFloats),
+		stats(w_ * h_) {
+		for (int k = 0; k < 3; ++k) lines[k].resize(size_t(pitch / lineFloats) * h_);
+		clear();
+	}
+
+	float *plane(int k) { return lines[k][0].v; }
+	const float *plane(int k) const { return lines[k][0].v; }
+	size_t offset(int i) const { return size_t(i / w) * pitch + i % w; }   // i as in c[]
+
+	// Adds one sample's value of pixel i (the mean over its subpixels)
+	void add(int i, const Vec &v) {
+		size_t k = offset(i);
+		plane(0)[k] += float(v.x);
+		plane(1)[k] += float(v.y);
+		plane(2)[k] += float(v.z);
+	}
+
+	Vec sum(int i) const {
+		size_t k = offset(i);
+		return Vec(plane(0)[k], plane(1)[k], plane(2)[k]);
+	}
+
+	// Mean radiance of pixel i, unclamped
+	Vec pixel(int i) const {
+		return stats[i].n ? sum(i) * (1. / stats[i].n) : Vec();
+	}
+
+	void resolve(std::vector<Vec> &c) const {
+		c.resize(w * h);
+		for (int i = 0; i < w * h; ++i) c[i] = pixel(i);
+	}
+
+	void clear();   // drops every sample, keeping the allocation
+
+	void sums(std::vector<Vec> &out) const {
+		out.resize(w * h);
+		for (int i = 0; i < w * h; ++i) out[i] = sum(i);
+	}
+
+	int w, h;
+	int samples;            // per subpixel taken by every pixel, so 4 * samples spp
+	int pitch;              // floats per row
+	std::vector<Line, FirstTouchAllocator<Line> > lines[3];
+	std::vector<PixelStats, FirstTouchAllocator<PixelStats> > stats;
+};
+
+
+/*
+* Image I/O
+*
+* Images are arrays of linear values, rows top to bottom. .pfm paths get
+* linear floats, anything else a binary PPM; both are written a row at a time.
+*/
+
+struct OutputSettings {
+	const char *path;
+	bool stream;    // write rows while the render is still running
+	const char *statsPath;  // render statistics as JSON, "-" for stdout
+	const char *partialPath;    // accumulation buffer for a later --merge
+	const char *checkpointPath; // render state to resume from and keep up to date
+	double checkpointInterval;  // seconds between checkpoint flushes
+
+	OutputSettings() : path("image.ppm"), stream(false), statsPath(0), partialPath(0), checkpointPath(0),
+		checkpointInterval(30) {}
+} output;
+
+inline bool isPFM(const char *path) {
+	size_t n = strlen(path);
+	return n >= 4 && !strcmp(path + n - 4, ".pfm");
+}
+
+inline bool littleEndian() {
+	const uint16_t one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
+// Returns the header length in bytes, or -1 on failure
+long writeImageHeader(FILE *f, bool pfm, int w, int h) {
+	int n = pfm ? fprintf(f, "PF\n%d %d\n%.1f\n", w, h, littleEndian() ? -1.0 : 1.0) :
+		fprintf(f, "P6\n%d %d\n255\n", w, h);
+	return n < 0 ? -1 : n;
+}
+
+// Encodes w pixels into buf (3 bytes or 3 floats each) and returns its size
+size_t encodeRow(bool pfm, const Vec *row, int w, std::vector<unsigned char> &buf) {
+	if (pfm) {
+		buf.resize(12 * size_t(w));
+		float *out = (float *)&buf[0];
+		for (int x = 0; x < w; ++x) {
+			out[3 * x] = float(row[x].x);
+			out[3 * x + 1] = float(row[x].y);
+			out[3 * x + 2] = float(row[x].z);
+		}
+	}
+	else {
+		buf.resize(3 * size_t(w));
+		for (int x = 0; x < w; ++x) {
+			buf[3 * x] = (unsigned char)toInt(row[x].x);
+			buf[3 * x + 1] = (unsigned char)toInt(row[x].y);
+			buf[3 * x + 2] = (unsigned char)toInt(row[x].z);
+		}
+	}
+	return buf.size();
+}
+
+// Writes c to path as PFM or binary PPM. PFM stores the bottom row first.
+bool writeImage(const char *path, bool pfm, int w, int h, const std::vector<Vec> &c) {
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+	bool ok = writeImageHeader(f, pfm, w, h) >= 0;
+	std::vector<unsigned char> buf;
+	for (int r = 0; ok && r < h; ++r) {
+		size_t n = encodeRow(pfm, &c[size_t(pfm ? h - 1 - r : r) * w], w, buf);
+		ok = fwrite(&buf[0], 1, n, f) == n;
+	}
+	return fclose(f) == 0 && ok;
+}
+
+// Writes an image while it renders: once a row's last tile is done, the
+// thread that finished it encodes the row and writes it at its final offset
+struct ImageStream {
+	ImageStream() : f(0) {}
+	~ImageStream() { close(); }
+
+	bool open(const char *path, const Film &film) {
+		close();
+		f = fopen(path, "wb");
+		if (!f) return false;
+		pfm = isPFM(path);
+		w = film.w;
+		h = film.h;
+		header = writeImageHeader(f, pfm, w, h);
+		ok = header >= 0;
+		std::vector<std::atomic<int> > rows(h);
+		for (int r = 0; r < h; ++r) rows[r].store(w);
+		pending.swap(rows);
+		return ok;
+	}
+
+	// Called once per tile after its pixels in film are final
+	void tileDone(const Film &film, const Tile &tile) {
+		std::vector<Vec> row;
+		std::vector<unsigned char> buf;
+		for (int y = tile.y0; y < tile.y0 + tile.h; ++y) {
+			const int r = h - 1 - y;   // image row, top first
+			if (pending[r].fetch_sub(tile.w) != tile.w) continue;
+			row.resize(w);
+			for (int x = 0; x < w; ++x) row[x] = film.pixel(r * w + x);
+			size_t n = encodeRow(pfm, &row[0], w, buf);
+			long offset = header + long(pfm ? h - 1 - r : r) * long(n);
+#pragma omp critical(imageStream)
+			ok = fseek(f, offset, SEEK_SET) == 0 && fwrite(&buf[0], 1, n, f) == n && ok;
+		}
+	}
+
+	// Returns false if anything failed since open()
+	bool close() {
+		if (!f) return true;
+		ok = fclose(f) == 0 && ok;
+		f = 0;
+		return ok;
+	}
+
+	FILE *f;
+	bool pfm, ok;
+	int w, h;
+	long header;
+	std::vector<std::atomic<int> > pending;   // pixels still rendering, per image row
+};
+
+// Renames tmp over path, replacing it
+bool replaceFile(const char *tmp, const char *path) {
+#ifdef _WIN32
+	remove(path);   // rename() does not replace an existing file on Windows
+#endif
+	return rename(tmp, path) == 0;
+}
+
+// Accumulation buffer of one process's share of a frame (--partial): per
+// pixel radiance sums and the number of samples behind them, so buffers of
+// any set of processes merge by adding both. Sections are 64-byte aligned.
+struct PartialHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t w, h;
+	uint64_t seed;
+	uint32_t firstSample, part, parts, pad;   // as in ClusterSettings
+	uint64_t sums, counts;   // three float planes of w * h, then w * h uint32
+};
+
+const char partialMagic[8] = { 'S', 'P', 'T', 'P', 'A', 'R', 'T', 0 };
+const uint32_t partialVersion = 1;
+
+// Writes film through a temporary file, like replaceImage()
+bool writePartial(const char *path, const Film &film) {
+	const int n = film.w * film.h;
+	PartialHeader hdr = PartialHeader();
+	memcpy(hdr.magic, partialMagic, sizeof(partialMagic));
+	hdr.version = partialVersion;
+	hdr.byteOrder = sceneByteOrder;
+	hdr.w = uint32_t(film.w);
+	hdr.h = uint32_t(film.h);
+	hdr.seed = settings.seed;
+	hdr.firstSample = uint32_t(cluster.firstSample);
+	hdr.part = uint32_t(cluster.part);
+	hdr.parts = uint32_t(cluster.parts);
+
+	std::vector<float> planes[3];
+	std::vector<uint32_t> counts(n);
+	for (int k = 0; k < 3; ++k) planes[k].resize(n);
+	for (int i = 0; i < n; ++i) {
+		const size_t o = film.offset(i);
+		for (int k = 0; k < 3; ++k) planes[k][i] = film.plane(k)[o];
+		counts[i] = uint32_t(film.stats[i].n);
+	}
+	const void *data[] = { planes[0].data(), planes[1].data(), planes[2].data(), counts.data() };
+	const size_t bytes[] = { n * sizeof(float), n * sizeof(float), n * sizeof(float), n * sizeof(uint32_t) };
+	uint64_t offsets[4];
+	layoutSections(bytes, 4, sizeof(hdr), offsets);
+	hdr.sums = offsets[0];
+	hdr.counts = offsets[3];
+
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.part", path);
+	FILE *f = fopen(tmp, "wb");
+	if (!f) return false;
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && writeSections(f, data, bytes, offsets, 4);
+	ok = fclose(f) == 0 && ok;
+	return ok && replaceFile(tmp, path);
+}
+
+// Adds up the accumulation buffers at paths into the w x h image c of their
+// means. Buffers may come from any mix of tile and sample splits; pixels
+// nobody sampled are reported (and left black) rather than failing the
+// merge, so only the missing parts need rendering again.
+bool mergePartials(int n, const char *const *paths, int &w, int &h, std::vector<Vec> &c) {
+	w = h = 0;
+	std::vector<double> sums;
+	std::vector<uint64_t> counts;
+	// pixels covered so far per (seed, first sample): a second buffer
+	// covering one of them repeats the same samples
+	std::vector<std::pair<std::pair<uint64_t, uint32_t>, std::vector<char> > > streams;
+
+	for (int k = 0; k < n; ++k) {
+		MappedFile file;
+		const PartialHeader *hdr = file.open(paths[k]) ? file.at<PartialHeader>(0, 1) : 0;
+		if (!hdr || memcmp(hdr->magic, partialMagic, sizeof(partialMagic)) || hdr->version != partialVersion ||
+			hdr->byteOrder != sceneByteOrder) {
+			fprintf(stderr, "%s: not an accumulation buffer of this version and byte order\n", paths[k]);
+			return false;
+		}
+		if (!k) {
+			w = int(hdr->w);
+			h = int(hdr->h);
+			sums.assign(3 * size_t(w) * h, 0.0);
+			counts.assign(size_t(w) * h, 0);
+		}
+		const size_t pixels = size_t(w) * h;
+		const float *planes[3];
+		const uint64_t plane = alignSection(pixels * sizeof(float));
+		for (int p = 0; p < 3; ++p) planes[p] = file.at<float>(hdr->sums + p * plane, pixels);
+		const uint32_t *cnt = file.at<uint32_t>(hdr->counts, pixels);
+		if (int(hdr->w) != w || int(hdr->h) != h || !planes[0] || !planes[1] || !planes[2] || !cnt) {
+			fprintf(stderr, "%s: truncated, or not %d x %d\n", paths[k], w, h);
+			return false;
+		}
+
+		const std::pair<uint64_t, uint32_t> key(hdr->seed, hdr->firstSample);
+		size_t stream = 0;
+		while (stream < streams.size() && streams[stream].first != key) ++stream;
+		if (stream == streams.size()) streams.push_back(std::make_pair(key, std::vector<char>(pixels, 0)));
+		std::vector<char> &covered = streams[stream].second;
+
+		long long repeated = 0, sampled = 0;
+		for (size_t i = 0; i < pixels; ++i) {
+			if (!cnt[i]) continue;
+			++sampled;
+			repeated += covered[i];
+			covered[i] = 1;
+			for (int c = 0; c < 3; ++c) sums[3 * i + c] += planes[c][i];
+			counts[i] += cnt[i];
+		}
+		fprintf(stderr, "%s: part %u/%u, %lld pixels\n", paths[k], hdr->part, hdr->parts, sampled);
+		if (repeated)
+			fprintf(stderr, "%s: %lld pixels repeat samples of an earlier buffer (same --seed and --first-sample)\n",
+				paths[k], repeated);
+	}
+
+	c.assign(size_t(w) * h, Vec());
+	long long missing = 0;
+	double total = 0;
+	for (size_t i = 0; i < c.size(); ++i) {
+		if (counts[i]) c[i] = Vec(sums[3 * i], sums[3 * i + 1], sums[3 * i + 2]) * (1.0 / counts[i]);
+		else ++missing;
+		total += counts[i];
+	}
+	if (missing) fprintf(stderr, "%lld of %d pixels have no samples; render their parts again\n", missing, w * h);
+	fprintf(stderr, "Merged %d buffers, %.1f spp on average\n", n, 4 * total / (double(w) * h));
+	return true;
+}
+
+// Checkpoint of an in-flight render (--checkpoint): this header, then one
+// 32-byte record per pixel. Records are rewritten whole as tiles finish and
+// never straddle a disk sector, so a crash leaves each pixel's sum and
+// sample count in step.
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t w, h;
+	uint64_t seed;
+	uint32_t firstSample, part, parts, sampler;   // a resume must match all of these
+	uint64_t pixels;   // offset of w * h CheckpointPixel
+};
+
+struct CheckpointPixel {
+	float sum[3];
+	int32_t n;
+	double mean, m2;   // as in PixelStats
+};
+
+const char checkpointMagic[8] = { 'S', 'P', 'T', 'C', 'K', 'P', 'T', 0 };
+const uint32_t checkpointVersion = 1;
+
+// The file is mapped shared and finished tiles are copied into it, so a
+// checkpoint is only msync(MS_ASYNC): the kernel writes the pages back while
+// rendering goes on. Without mmap (Windows) the file is rewritten instead.
+struct Checkpoint {
+	Checkpoint() : data(0), size(0), interval(0), nextFlush(0) {}
+	~Checkpoint() { close(); }
+
+	// Maps path and loads its pixels into film, creating it if it does not
+	// exist. Fails, leaving the file alone, if it holds another render.
+	bool open(const char *path, Film &film, double interval);
+
+	// Called once per tile after its pixels in film are final; flushes the
+	// file if interval seconds have passed since the last flush
+	void tileDone(const Film &film, const Tile &tile);
+
+	bool flush();
+	bool close();   // flushes and waits for the writes to finish
+
+	unsigned char *data;
+	size_t size;
+	double interval, nextFlush;
+#ifdef _WIN32
+	std::vector<unsigned char> buffer;
+	std::string path;
+#endif
+};
+
+bool Checkpoint::open(const char *path_, Film &film, double interval_) {
+	close();
+	const size_t n = size_t(film.w) * film.h;
+	CheckpointHeader want = CheckpointHeader();
+	memcpy(want.magic, checkpointMagic, sizeof(checkpointMagic));
+	want.version = checkpointVersion;
+	want.byteOrder = sceneByteOrder;
+	want.w = uint32_t(film.w);
+	want.h = uint32_t(film.h);
+	want.seed = settings.seed;
+	want.firstSample = uint32_t(cluster.firstSample);
+	want.part = uint32_t(cluster.part);
+	want.parts = uint32_t(cluster.parts);
+	want.sampler = uint32_t(settings.sampler);
+	want.pixels = alignSection(sizeof(want));
+	const size_t bytes = size_t(want.pixels) + n * sizeof(CheckpointPixel);
+
+	bool fresh = false;
+#ifndef _WIN32
+	int fd = ::open(path_, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s\n", path_);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (st.st_size == 0 || size_t(st.st_size) == bytes)) {
+		fresh = st.st_size == 0;
+		if (!fresh || ftruncate(fd, off_t(bytes)) == 0) {
+			void *p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) {
+				data = (unsigned char *)p;
+				size = bytes;
+			}
+		}
+	}
+	::close(fd);
+#else
+	path = path_;
+	buffer.assign(bytes, 0);
+	FILE *f = fopen(path_, "rb");
+	fresh = !f;
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		if (ftell(f) == long(bytes) && fseek(f, 0, SEEK_SET) == 0 && fread(&buffer[0], 1, bytes, f) == bytes) {
+			data = &buffer[0];
+			size = bytes;
+		}
+		fclose(f);
+	}
+	else {
+		data = &buffer[0];
+		size = bytes;
+	}
+#endif
+	if (!data || (!fresh && memcmp(data, &want, sizeof(want)))) {
+		fprintf(stderr, "%s: not a checkpoint of this frame size, seed, sampler and split\n", path_);
+		close();
+		return false;
+	}
+	if (fresh) memcpy(data, &want, sizeof(want));
+
+	const CheckpointPixel *pixels = (const CheckpointPixel *)(data + want.pixels);
+	for (size_t i = 0; i < n; ++i) {
+		const size_t o = film.offset(int(i));
+		for (int k = 0; k < 3; ++k) film.plane(k)[o] = pixels[i].sum[k];
+		film.stats[i].n = pixels[i].n;
+		film.stats[i].mean = pixels[i].mean;
+		film.stats[i].m2 = pixels[i].m2;
+	}
+	interval = interval_;
+	nextFlush = omp_get_wtime() + interval;
+	return true;
+}
+
+void Checkpoint::tileDone(const Film &film, const Tile &tile) {
+	CheckpointPixel *pixels = (CheckpointPixel *)(data + ((const CheckpointHeader *)data)->pixels);
+#ifdef _WIN32
+#pragma omp critical(checkpoint)   // flush() reads the buffer
+#endif
+	for (int y = tile.y0; y < tile.y0 + tile.h; ++y)
+		for (int x = tile.x0; x < tile.x0 + tile.w; ++x) {
+			const int i = (film.h - y - 1) * film.w + x;
+			const Vec s = film.sum(i);
+			CheckpointPixel p;
+			p.sum[0] = float(s.x);
+			p.sum[1] = float(s.y);
+			p.sum[2] = float(s.z);
+			p.n = film.stats[i].n;
+			p.mean = film.stats[i].mean;
+			p.m2 = film.stats[i].m2;
+			pixels[i] = p;
+		}
+
+	bool due;
+#pragma omp critical(checkpointClock)
+	{
+		const double now = omp_get_wtime();
+		due = now >= nextFlush;
+		if (due) nextFlush = now + interval;
+	}
+	if (due) flush();
+}
+
+bool Checkpoint::flush() {
+	if (!data) return true;
+#ifndef _WIN32
+	return msync(data, size, MS_ASYNC) == 0;
+#else
+	bool ok;
+#pragma omp critical(checkpoint)
+	{
+		const std::string tmp = path + ".part";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		ok = f && fwrite(data, 1, size, f) == size;
+		ok = f && fclose(f) == 0 && ok;
+		ok = ok && replaceFile(tmp.c_str(), path.c_str());
+	}
+	return ok;
+#endif
+}
+
+bool Checkpoint::close() {
+	if (!data) return true;
+#ifndef _WIN32
+	bool ok = msync(data, size, MS_SYNC) == 0;
+	munmap(data, size);
+#else
+	bool ok = flush();
+	buffer.clear();
+#endif
+	data = 0;
+	size = 0;
+	return ok;
+}
+
+// Reads an 8-bit P3 or P6 PPM as display values in [0, 255]
+bool readPPM(const char *path, int &w, int &h, std::vector<Vec> &c) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	char magic[3] = { 0 };
+	int maxval = 0;
+	bool ok = fscanf(f, "%2s %d %d %d", magic, &w, &h, &maxval) == 4 && maxval == 255 &&
+		(!strcmp(magic, "P3") || !strcmp(magic, "P6"));
+	if (ok) {
+		c.assign(w*h, Vec());
+		if (magic[1] == '6') {
+			fgetc(f);
+			std::vector<unsigned char> buf(3 * w*h);
+			ok = fread(&buf[0], 1, buf.size(), f) == buf.size();
+			for (int i = 0; ok && i < w*h; ++i) c[i] = Vec(buf[3 * i], buf[3 * i + 1], buf[3 * i + 2]);
+		}
+		else {
+			for (int i = 0; ok && i < w*h; ++i) {
+				int r, g, b;
+				ok = fscanf(f, "%d %d %d", &r, &g, &b) == 3;
+				c[i] = Vec(r, g, b);
+			}
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+// RMSE in 8-bit display units between a linear render and an 8-bit image
+double displayRMSE(const std::vector<Vec> &c, const std::vector<Vec> &ref) {
+	double sum = 0;
+	for (size_t i = 0; i < c.size(); ++i) {
+		Vec d = Vec(toInt(c[i].x), toInt(c[i].y), toInt(c[i].z)) - ref[i];
+		sum += d.dot(d);
+	}
+	return std::sqrt(sum / (3.0 * c.size()));
+}
+
+// Mean over channels of (c - ref)^2 / (ref^2 + 0.01) in linear radiance,
+// with c clamped to [0, 1] and ref decoded from 8-bit gamma as above
+double relativeMSE(const std::vector<Vec> &c, const std::vector<Vec> &ref) {
+	double sum = 0;
+	for (size_t i = 0; i < c.size(); ++i) {
+		const double v[3] = { c[i].x, c[i].y, c[i].z }, r8[3] = { ref[i].x, ref[i].y, ref[i].z };
+		for (int k = 0; k < 3; ++k) {
+			double r = pow(r8[k] / 255, 2.2), d = clamp(v[k]) - r;
+			sum += d * d / (r * r + 0.01);
+		}
+	}
+	return sum / (3.0 * c.size());
+}
+
+
+// Reads a three-channel PFM in either byte order, as writeImage() or an
+// external tool writes it
+bool readPFM(const char *path, int &w, int &h, std::vector<Vec> &c) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	char magic[3] = { 0 };
+	double scale = 0;
+	bool ok = fscanf(f, "%2s %d %d %lf", magic, &w, &h, &scale) == 4 && !strcmp(magic, "PF") &&
+		w > 0 && h > 0 && scale != 0;
+	if (ok) {
+		fgetc(f);
+		std::vector<unsigned char> buf(12 * size_t(w) * h);
+		ok = fread(&buf[0], 1, buf.size(), f) == buf.size();
+		const bool swap = (scale < 0) != littleEndian();
+		c.assign(size_t(w) * h, Vec());
+		for (int r = 0; ok && r < h; ++r)   // rows run bottom to top in the file
+			for (int x = 0; x < w; ++x) {
+				float v[3];
+				for (int k = 0; k < 3; ++k) {
+					unsigned char *b = &buf[12 * (size_t(r) * w + x) + 4 * k];
+					if (swap) { std::swap(b[0], b[3]); std::swap(b[1], b[2]); }
+					memcpy(&v[k], b, 4);
+				}
+				c[size_t(h - 1 - r) * w + x] = Vec(v[0], v[1], v[2]);
+			}
+	}
+	fclose(f);
+	return ok;
+}
+
+
+/*
+* Denoising
+*
+* --denoise filters the finished image with an edge-avoiding a-trous wavelet
+* filter (Dammertz et al. 2010, "Edge-Avoiding A-Trous Wavelet Transform for
+* fast Global Illumination Filtering") guided, as in SVGF (Schied et al.
+* 2017), by each pixel's variance from its PixelStats. Albedo and normal of
+* the first diffuse surface behind every pixel come from a cheap pass over
+* the render's first camera rays. --denoise-hook hands the same three
+* images to an external denoiser instead.
+*/
+
+struct DenoiseSettings {
+	bool enabled;
+	const char *hook;   // command run as: hook color.pfm albedo.pfm normal.pfm out.pfm
+	int featureSamples; // per subpixel in the feature pass
+
+	DenoiseSettings() : enabled(false), hook(0), featureSamples(4) {}
+} denoise;
+
+// Per-pixel mean albedo and normal of the first non-mirror surface seen
+// through the first denoise.featureSamples camera rays of every subpixel,
+// which are the render's own first rays; mirrors are looked through
+void renderFeatures(int w, int h, std::vector<Vec> &albedo, std::vector<Vec> &normal) {
+	Vec cx, cy;
+	cam.axes(w, h, cx, cy);
+	albedo.assign(size_t(w) * h, Vec());
+	normal.assign(size_t(w) * h, Vec());
+	const int samples = std::max(1, denoise.featureSamples);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = 0; y < h; ++y) {
+		Sampler sampler(settings.sampler, settings.seed);
+		for (int x = 0; x < w; ++x) {
+			const int i = (h - y - 1) * w + x;
+			Vec a, nsum;
+			for (int s = 0; s < samples; ++s)
+				for (int sub = 0; sub < 4; ++sub) {
+					sampler.startSample(x, y, i, subpixelSample(sub, cluster.firstSample + s));
+					Ray ray = cameraRay(cx, cy, w, h, x, y, sub & 1, sub >> 1, sampler);
+					Vec weight(1, 1, 1);
+					for (int depth = 1; depth <= settings.maxDepth; ++depth) {
+						double t;
+						int id = 0;
+						if (!intersect(ray, t, id)) break;
+						const Vec p = ray.o + ray.d*t, o = Vec() - ray.d;
+						Vec n = primitiveNormal(id, p);
+						if (n.dot(o) < 0) n = n*-1.0;
+						const BRDF &brdf = primitiveBRDF(id);
+						if (!brdf.isSpecular()) {
+							a = a + weight.mult(brdf.k);
+							nsum = nsum + n;
+							break;
+						}
+						weight = weight.mult(brdf.k);
+						Vec d;
+						BRDFKernel<BRDF_SPECULAR>::mirroredDirection(n, o, d);
+						ray = Ray(spawnOrigin(p, n), d);
+					}
+				}
+			albedo[i] = a * (1.0 / (4 * samples));
+			normal[i] = nsum * (1.0 / (4 * samples));
+		}
+	}
+}
+
+// Filters c, the resolved film, in place
+void atrousFilter(const Film &film, const std::vector<Vec> &albedo, const std::vector<Vec> &normal,
+	std::vector<Vec> &c) {
+	const int w = film.w, h = film.h, n = w * h;
+	const double sigmaLuminance = 4, sigmaAlbedo = 0.1, normalPower = 64, floor = 1e-2;
+	const double kernel[3] = { 3.0 / 8, 1.0 / 4, 1.0 / 16 };   // B3 spline
+
+	// Filter irradiance, color over albedo, so material edges survive
+	std::vector<Vec> cur(n), next(n), unit(n);
+	std::vector<double> var(n), nextVar(n);
+	std::vector<Vec> demod(n);
+	for (int i = 0; i < n; ++i) {
+		const Vec &a = albedo[i];
+		demod[i] = Vec(std::max<double>(a.x, floor), std::max<double>(a.y, floor), std::max<double>(a.z, floor));
+		cur[i] = Vec(c[i].x / demod[i].x, c[i].y / demod[i].y, c[i].z / demod[i].z);
+		const double len = std::sqrt(normal[i].dot(normal[i]));
+		unit[i] = len > 0 ? normal[i] * (1 / len) : Vec();
+		// variance of the pixel mean, scaled like the demodulated color
+		const PixelStats &s = film.stats[i];
+		const double l = std::max(luminance(demod[i]), floor);
+		var[i] = s.n > 1 ? s.m2 / (double(s.n) * (s.n - 1)) / (l * l) : 1e10;
+	}
+
+	for (int step = 1; step <= 16; step *= 2) {
+#pragma omp parallel for schedule(dynamic, 4)
+		for (int y = 0; y < h; ++y)
+			for (int x = 0; x < w; ++x) {
+				const int p = y * w + x;
+				const double lp = luminance(cur[p]), sd = sigmaLuminance * std::sqrt(var[p]) + 1e-10;
+				Vec sum;
+				double wsum = 0, vsum = 0;
+				for (int dy = -2; dy <= 2; ++dy) {
+					const int qy = y + dy * step;
+					if (qy < 0 || qy >= h) continue;
+					for (int dx = -2; dx <= 2; ++dx) {
+						const int qx = x + dx * step;
+						if (qx < 0 || qx >= w) continue;
+						const int q = qy * w + qx;
+						const Vec da = albedo[p] - albedo[q];
+						double wq = kernel[std::abs(dx)] * kernel[std::abs(dy)] *
+							std::exp(-std::abs(lp - luminance(cur[q])) / sd - da.dot(da) / (sigmaAlbedo * sigmaAlbedo));
+						if (q != p) wq *= std::pow(std::max<double>(0, unit[p].dot(unit[q])), normalPower);
+						sum = sum + cur[q] * wq;
+						wsum += wq;
+						vsum += wq * wq * var[q];
+					}
+				}
+				next[p] = sum * (1 / wsum);
+				nextVar[p] = vsum / (wsum * wsum);
+			}
+		cur.swap(next);
+		var.swap(nextVar);
+	}
+	for (int i = 0; i < n; ++i) c[i] = cur[i].mult(demod[i]);
+}
+
+// Runs denoise.hook on c and the feature images, written as PFMs next to
+// base, and reads its output back into c
+bool runDenoiseHook(const char *base, int w, int h, const std::vector<Vec> &albedo,
+	const std::vector<Vec> &normal, std::vector<Vec> &c) {
+	const std::string b = base, color = b + ".color.pfm", alb = b + ".albedo.pfm", nrm = b + ".normal.pfm",
+		out = b + ".denoised.pfm";
+	if (!writeImage(color.c_str(), true, w, h, c) || !writeImage(alb.c_str(), true, w, h, albedo) ||
+		!writeImage(nrm.c_str(), true, w, h, normal)) {
+		fprintf(stderr, "Cannot write the denoiser inputs next to %s\n", base);
+		return false;
+	}
+	const std::string cmd = std::string(denoise.hook) + " \"" + color + "\" \"" + alb + "\" \"" + nrm + "\" \"" +
+		out + "\"";
+	int ow, oh;
+	std::vector<Vec> result;
+	bool ok = system(cmd.c_str()) == 0;
+	if (!ok) fprintf(stderr, "Denoiser failed: %s\n", cmd.c_str());
+	else if (!(ok = readPFM(out.c_str(), ow, oh, result) && ow == w && oh == h))
+		fprintf(stderr, "Denoiser wrote no %d x %d PFM to %s\n", w, h, out.c_str());
+	else c.swap(result);
+	remove(color.c_str());
+	remove(alb.c_str());
+	remove(nrm.c_str());
+	remove(out.c_str());
+	return ok;
+}
+
+// Denoises c, resolved from film, as the denoise settings ask; base names
+// the hook's temporary files. On failure c keeps the noisy image.
+bool denoiseImage(const Film &film, const char *base, std::vector<Vec> &c) {
+	if (!denoise.enabled && !denoise.hook) return true;
+	const double t0 = omp_get_wtime();
+	std::vector<Vec> albedo, normal;
+	renderFeatures(film.w, film.h, albedo, normal);
+	bool ok = true;
+	if (denoise.hook) ok = runDenoiseHook(base, film.w, film.h, albedo, normal, c);
+	else atrousFilter(film, albedo, normal, c);
+	if (ok) fprintf(stderr, "Denoised in %.2f s\n", omp_get_wtime() - t0);
+	return ok;
+}
+
+
+/*
+* Tile scheduler
+*
+* The image is cut into square tiles listed in Morton order, so consecutive
+* tiles are close on screen. Every thread starts with a contiguous run of
+* that list and takes tiles from the front of it; a thread whose run is empty
+* steals the back half of another thread's run. Each run is a single atomic
+* word, so taking and stealing are both one compare-and-swap.
+*/
+
+// Interleaves the low 16 bits of x with zeros
+inline uint32_t spreadBits(uint32_t x) {
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+inline uint32_t morton2D(uint32_t x, uint32_t y) { return spreadBits(x) | (spreadBits(y) << 1); }
+
+inline bool ownsTile(int tx, int ty, int tilesX) {
+	return (ty * tilesX + tx) % cluster.parts == cluster.part;
+}
+
+// Whether image pixel i (as in c[]) of a w x h frame is this process's to render
+inline bool ownsPixel(int w, int h, int i) {
+	if (cluster.parts <= 1) return true;
+	const int ts = std::max(1, settings.tileSize), x = i % w, y = h - 1 - i / w;
+	return ownsTile(x / ts, y / ts, (w + ts - 1) / ts);
+}
+
+// Half-open range [head, tail) of tile indices, packed as tail << 32 | head
+struct alignas(64) TileRange {
+	std::atomic<uint64_t> bits;
+
+	static uint64_t pack(uint32_t head, uint32_t tail) { return uint64_t(tail) << 32 | head; }
+};
+
+struct TileScheduler {
+	TileScheduler(int w, int h, int tileSize, int nthreads);
+
+	// Next tile for thread t, stealing if its own range is empty. Returns
+	// false once every tile has been handed out.
+	bool next(int t, Tile &tile);
+
+	// Records n finished pixels and returns the fraction of the image done
+	// before and after
+	void finish(int n, double &before, double &after);
+
+	std::vector<Tile> tiles;      // Morton order
+	std::vector<TileRange> runs;  // one per thread
+	std::atomic<int> pixelsDone;
+	int pixels;
+};
+
+TileScheduler::TileScheduler(int w, int h, int tileSize, int nthreads) : runs(nthreads), pixelsDone(0), pixels(0) {
+	tileSize = std::max(1, tileSize);
+	const int tilesX = (w + tileSize - 1) / tileSize, tilesY = (h + tileSize - 1) / tileSize;
+	std::vector<std::pair<uint32_t, int> > order;
+	for (int ty = 0; ty < tilesY; ++ty)
+		for (int tx = 0; tx < tilesX; ++tx)
+			if (ownsTile(tx, ty, tilesX)) order.push_back(std::make_pair(morton2D(tx, ty), ty * tilesX + tx));
+	std::sort(order.begin(), order.end());
+
+	for (size_t k = 0; k < order.size(); ++k) {
+		const int tx = order[k].second % tilesX, ty = order[k].second / tilesX;
+		Tile tile;
+		tile.x0 = tx * tileSize;
+		tile.y0 = ty * tileSize;
+		tile.w = std::min(tileSize, w - tile.x0);
+		tile.h = std::min(tileSize, h - tile.y0);
+		tiles.push_back(tile);
+		pixels += tile.w * tile.h;
+	}
+
+	const uint64_t n = tiles.size();
+	for (int t = 0; t < nthreads; ++t)
+		runs[t].bits.store(TileRange::pack(uint32_t(n * t / nthreads), uint32_t(n * (t + 1) / nthreads)));
+}
+
+bool TileScheduler::next(int t, Tile &tile) {
+	const int nthreads = int(runs.size());
+	t %= nthreads;
+
+	// Own run, from the front
+	uint64_t r = runs[t].bits.load(std::memory_order_relaxed);
+	for (;;) {
+		uint32_t head = uint32_t(r), tail = uint32_t(r >> 32);
+		if (head >= tail) break;
+		if (runs[t].bits.compare_exchange_weak(r, TileRange::pack(head + 1, tail), std::memory_order_relaxed)) {
+			tile = tiles[head];
+			return true;
+		}
+	}
+
+	// Steal the back half of the first non-empty run after ours. Only the
+	// owner ever writes an empty run, so the store below cannot race.
+	for (int k = 1; k < nthreads; ++k) {
+		TileRange &victim = runs[(t + k) % nthreads];
+		r = victim.bits.load(std::memory_order_relaxed);
+		for (;;) {
+			uint32_t head = uint32_t(r), tail = uint32_t(r >> 32);
+			if (head >= tail) break;
+			uint32_t mid = tail - (tail - head + 1) / 2;
+			if (victim.bits.compare_exchange_weak(r, TileRange::pack(head, mid), std::memory_order_relaxed)) {
+				runs[t].bits.store(TileRange::pack(mid + 1, tail), std::memory_order_relaxed);
+				tile = tiles[mid];
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void TileScheduler::finish(int n, double &before, double &after) {
+	int prev = pixelsDone.fetch_add(n, std::memory_order_relaxed);
+	before = double(prev) / pixels;
+	after = double(prev + n) / pixels;
+}
+
+void Film::clear() {
+	TileScheduler sched(w, h, settings.tileSize, omp_get_max_threads());
+	const int nthreads = int(sched.runs.size());
+	samples = 0;
+
+#pragma omp parallel num_threads(nthreads)
+	{
+		// The tiles this thread's run starts with, row by row, plus the
+		// padding after rows that end in them
+		const uint64_t r = sched.runs[omp_get_thread_num()].bits.load(std::memory_order_relaxed);
+		for (uint32_t k = uint32_t(r); k < uint32_t(r >> 32); ++k) {
+			const Tile &tile = sched.tiles[k];
+			const int end = tile.x0 + tile.w == w ? pitch - tile.x0 : tile.w;
+			for (int y = tile.y0; y < tile.y0 + tile.h; ++y) {
+				const int i = (h - y - 1) * w + tile.x0;
+				for (int p = 0; p < 3; ++p) memset(plane(p) + offset(i), 0, sizeof(float) * end);
+				for (int x = 0; x < tile.w; ++x) stats[i + x] = PixelStats();
+			}
+		}
+		// Pixels of other processes' tiles, which this one never renders
+		if (cluster.parts > 1) {
+#pragma omp for
+			for (int i = 0; i < w * h; ++i)
+				if (!ownsPixel(w, h, i)) {
+					const size_t o = offset(i);
+					for (int p = 0; p < 3; ++p) plane(p)[o] = 0;
+					stats[i] = PixelStats();
+					if (i % w == w - 1)
+						for (int p = 0; p < 3; ++p) memset(plane(p) + o + 1, 0, sizeof(float) * (pitch - w));
+				}
+		}
+	}
+}
+
+// Progress line, printed only when a tile crosses a whole percent
+inline void reportProgress(const char *label, int spp, double before, double after) {
+	if (int(before * 100) != int(after * 100))
+		fprintf(stderr, "\rRendering (%d spp%s) %6.2f%%", spp, label, 100. * after);
+}
+
+// Adds samps samples per subpixel to every pixel of film (or only to those
+// set in active), one full path per sample, tiles distributed over threads.
+// Without active, pixels a resumed checkpoint left ahead take only what
+// brings them to film.samples + samps.
+void renderMegakernel(Film &film, int samps, const std::vector<char> *active, ImageStream *stream,
+	Checkpoint *checkpoint, const Vec &cx, const Vec &cy) {
+	const int w = film.w, h = film.h;
+	TileScheduler sched(w, h, settings.tileSize, omp_get_max_threads());
+
+#pragma omp parallel
+	{
+		Sampler sampler(settings.sampler, settings.seed);
+		Tile tile;
+		while (sched.next(omp_get_thread_num(), tile)) {
+			for (int y = tile.y0; y < tile.y0 + tile.h; y++) {
+				for (int x = tile.x0; x < tile.x0 + tile.w; x++) {
+					const int i = (h - y - 1)*w + x;
+					if (active && !(*active)[i]) continue;
+
+					PixelStats &stats = film.stats[i];
+					const int todo = active ? samps : film.samples + samps - stats.n;
+					for (int s = 0; s < todo; s++) {
+						Vec pixel;
+						for (int sub = 0; sub < 4; ++sub) {
+							sampler.startSample(x, y, i, subpixelSample(sub, cluster.firstSample + stats.n));
+							const Ray ray = cameraRay(cx, cy, w, h, x, y, sub & 1, sub >> 1, sampler);
+							pixel = pixel + (settings.spectral ? spectralRadiance(ray, sampler) :
+								receivedRadiance(ray, 1, true, sampler));
+						}
+						pixel = pixel * .25;
+						film.add(i, pixel);
+						stats.add(luminance(pixel));
+					}
+				}
+			}
+			if (stream) stream->tileDone(film, tile);
+			if (checkpoint) checkpoint->tileDone(film, tile);
+			double before, after;
+			sched.finish(tile.w * tile.h, before, after);
+			reportProgress(active ? ", adaptive" : "", (film.samples + samps) * 4, before, after);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+
+/*
+* Wavefront renderer
+*
+* Paths of a tile advance together one bounce at a time: intersect every
+* live ray, group the hits by BRDF, shade each group in a batch (queueing
+* shadow rays and continuation rays), trace the shadow queue, repeat with
+* the continuation queue. Produces the same estimator as receivedRadiance().
+*/
+
+struct WavefrontPath {
+	Sampler sampler;   // the path's own sample stream
+	Ray ray;
+	Vec beta;       // path throughput
+	int slot;       // subpixel accumulator receiving this path
+	int depth;
+	bool flag;      // count emission at the next hit
+	int diffuse;    // diffuse vertices so far, for the caustic map
+	Real prevPdf; // BRDF pdf of ray.d at ray.o, for MIS
+
+	WavefrontPath() : ray(Vec(), Vec()), slot(0), depth(1), flag(true), diffuse(0), prevPdf(0) {}
+};
+
+struct WavefrontHit {
+	const BRDF *brdf;   // sort key, after the BRDF type
+	int path;
+	int id;
+	double t;
+
+	bool operator<(const WavefrontHit &b) const {
+		return brdf->type != b.brdf->type ? brdf->type < b.brdf->type : brdf < b.brdf;
+	}
+};
+
+struct WavefrontShadowRay {
+	Ray ray;
+	Vec contrib;    // already weighted by the path throughput
+	Real tmax;
+	int slot;
+
+	WavefrontShadowRay() : ray(Vec(), Vec()), tmax(0), slot(0) {}
+};
+
+struct WavefrontQueues {
+	std::vector<WavefrontPath> paths, next;
+	std::vector<WavefrontHit> hits;
+	std::vector<WavefrontShadowRay> shadow;
+	std::vector<Vec> sampleSum;   // radiance of the current sample, per slot
+	std::vector<int> pixels;      // image index of every fourth slot
+	std::vector<CachePath> cache; // per slot, with the radiance cache on
+};
+
+// Shades q.hits[begin, end), which all have BRDF type Type, emitting shadow
+// rays and continuation paths
+template <int Type>
+void shadeWavefront(WavefrontQueues &q, size_t begin, size_t end) {
+	typedef BRDFKernel<Type> Kernel;
+
+	for (size_t k = begin; k < end; ++k) {
+		const WavefrontHit &hit = q.hits[k];
+		WavefrontPath &path = q.paths[hit.path];
+		const Vec &kr = hit.brdf->k;
+
+		Vec x = path.ray.o + path.ray.d*hit.t;
+		Vec o = (Vec() - path.ray.d).normalize();
+		Vec n = primitiveNormal(hit.id, x);
+		if (n.dot(o) < 0) n = n*-1.0;
+		x = spawnOrigin(x, n);
+		const Frame frame(n);
+
+		if (path.flag) {
+			if (!caustics.gathered(path.diffuse))
+				q.sampleSum[path.slot] = q.sampleSum[path.slot] + path.beta.mult(primitiveEmission(hit.id));
+		}
+		else if (settings.mis && path.prevPdf > 0 && lightIndex(hit.id) >= 0)
+			q.sampleSum[path.slot] = q.sampleSum[path.slot] +
+				path.beta.mult(primitiveEmission(hit.id)) * emissionWeight(path.ray.o, path.prevPdf, hit.id, x, n);
+		const int dim = bounceDimension(path.depth);
+		if (!Kernel::specular && radianceCache.cell > 0 &&
+			q.cache[path.slot].visit(x, n, kr, path.beta, q.sampleSum[path.slot])) {
+			countPath(path.depth);
+			continue;
+		}
+		if (!Kernel::specular) {
+			WavefrontShadowRay sr;
+			Vec dir;
+			path.sampler.setDimension(dim + DIM_LIGHT);
+			if (sampleDirect(hit.id, *hit.brdf, Ray(x, o), frame, sr.contrib, dir, sr.tmax, path.sampler)) {
+				sr.ray = Ray(x, dir);
+				sr.contrib = path.beta.mult(sr.contrib);
+				sr.slot = path.slot;
+				q.shadow.push_back(sr);
+			}
+			if (caustics.gathered(++path.diffuse))
+				q.sampleSum[path.slot] = q.sampleSum[path.slot] +
+					path.beta.mult(kr).mult(caustics.irradiance(x, n)) * (1 / PI);
+		}
+
+		// paths that stop here end with path.depth vertices
+		if (path.depth >= settings.maxDepth) { countPath(path.depth); continue; }
+
+		Real p = 1.0;
+		if (path.depth >= settings.rrDepth) {
+			p = std::min<Real>(0.95, std::max(path.beta.x, std::max(path.beta.y, path.beta.z)));
+			path.sampler.setDimension(dim + DIM_RR);
+			if (p <= 0 || path.sampler.get1D() >= p) { countPath(path.depth); continue; }
+		}
+
+		Vec i, fr;
+		Real pdf;
+		path.sampler.setDimension(dim + DIM_BRDF);
+		{
+			PHASE_TIMER(PHASE_BRDF);
+			Kernel::sample(kr, frame, o, i, pdf, path.sampler);
+			if (pdf > 0) fr = Kernel::eval(kr, frame, o, i);
+		}
+		if (pdf <= 0) { countPath(path.depth); continue; }
+
+		WavefrontPath cont;
+		cont.sampler = path.sampler;
+		cont.beta = path.beta.mult(fr) * (n.dot(i) / (pdf * p));
+		cont.ray = Ray(x, i);
+		cont.slot = path.slot;
+		cont.depth = path.depth + 1;
+		cont.flag = Kernel::specular;
+		cont.diffuse = path.diffuse;
+		cont.prevPdf = Kernel::specular ? 0 : pdf;
+		q.next.push_back(cont);
+	}
+}
+
+// Advances every path in q.paths to completion, adding radiance to q.sampleSum
+void traceWavefront(WavefrontQueues &q) {
+	while (!q.paths.empty()) {
+		// 1. Intersect
+		q.hits.clear();
+		for (int k = 0; k < int(q.paths.size()); ++k) {
+			WavefrontHit hit;
+			hit.path = k;
+			hit.id = 0;
+			if (intersect(q.paths[k].ray, hit.t, hit.id)) {
+				hit.brdf = &primitiveBRDF(hit.id);
+				q.hits.push_back(hit);
+			}
+			else countPath(q.paths[k].depth - 1);
+		}
+
+		// 2. Group by material so each batch below runs a single BRDF kernel
+		std::sort(q.hits.begin(), q.hits.end());
+
+		// 3. Shade each run of equal BRDF type
+		q.next.clear();
+		q.shadow.clear();
+		for (size_t begin = 0, end; begin < q.hits.size(); begin = end) {
+			const int type = q.hits[begin].brdf->type;
+			for (end = begin + 1; end < q.hits.size() && q.hits[end].brdf->type == type; ++end) {}
+			switch (type) {
+			case BRDF_SPECULAR: shadeWavefront<BRDF_SPECULAR>(q, begin, end); break;
+			default:            shadeWavefront<BRDF_DIFFUSE>(q, begin, end); break;
+			}
+		}
+
+		// 4. Shadow rays
+		for (size_t k = 0; k < q.shadow.size(); ++k) {
+			const WavefrontShadowRay &sr = q.shadow[k];
+			if (!occluded(sr.ray.o, sr.ray.d, sr.tmax))
+				q.sampleSum[sr.slot] = q.sampleSum[sr.slot] + sr.contrib;
+		}
+
+		q.paths.swap(q.next);
+	}
+}
+
+void renderWavefront(Film &film, int samps, const std::vector<char> *active, ImageStream *stream,
+	Checkpoint *checkpoint, const Vec &cx, const Vec &cy) {
+	const int w = film.w, h = film.h, target = film.samples + samps;
+	TileScheduler sched(w, h, settings.tileSize, omp_get_max_threads());
+
+#pragma omp parallel
+	{
+		WavefrontQueues q;
+		Tile tile;
+
+		while (sched.next(omp_get_thread_num(), tile)) {
+			for (int s = 0; ; ++s) {
+				// Pixels still short of this pass's samples, as in renderMegakernel()
+				q.pixels.clear();
+				for (int py = tile.y0; py < tile.y0 + tile.h; ++py)
+					for (int px = tile.x0; px < tile.x0 + tile.w; ++px) {
+						const int i = (h - py - 1)*w + px;
+						if (active ? (*active)[i] && s < samps : film.stats[i].n < target) q.pixels.push_back(i);
+					}
+				if (q.pixels.empty()) break;
+				const int slots = int(q.pixels.size()) * 4;   // 2x2 subpixels per pixel
+
+				// Generate one camera ray per subpixel
+				q.paths.resize(slots);
+				q.sampleSum.assign(slots, Vec());
+				for (int k = 0; k < slots; ++k) {
+					const int sub = k & 3, i = q.pixels[k >> 2], px = i % w, py = h - 1 - i / w;
+					WavefrontPath &path = q.paths[k];
+					path = WavefrontPath();
+					path.sampler = Sampler(settings.sampler, settings.seed);
+					path.sampler.startSample(px, py, i, subpixelSample(sub, cluster.firstSample + film.stats[i].n));
+					path.ray = cameraRay(cx, cy, w, h, px, py, sub & 1, sub >> 1, path.sampler);
+					path.beta = Vec(1, 1, 1);
+					path.slot = k;
+				}
+				if (radianceCache.cell > 0) q.cache.assign(slots, CachePath());
+				traceWavefront(q);
+				if (radianceCache.cell > 0)
+					for (int k = 0; k < slots; ++k) q.cache[k].finish(q.sampleSum[k]);
+				for (int k = 0; k < slots; k += 4) {
+					Vec pixel = (q.sampleSum[k] + q.sampleSum[k + 1] + q.sampleSum[k + 2] + q.sampleSum[k + 3]) * .25;
+					film.add(q.pixels[k >> 2], pixel);
+					film.stats[q.pixels[k >> 2]].add(luminance(pixel));
+				}
+			}
+
+			if (stream) stream->tileDone(film, tile);
+			if (checkpoint) checkpoint->tileDone(film, tile);
+			double before, after;
+			sched.finish(tile.w * tile.h, before, after);
+			reportProgress(active ? ", wavefront, adaptive" : ", wavefront", (film.samples + samps) * 4, before, after);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+
+/*
+* Device offload
+*
+* --device gpu runs each pass as one OpenMP target region: a device thread
+* per pixel traces its samples with the estimator of receivedRadiance(),
+* reading flat copies of the scene (BVH nodes, the leaf-order sphere planes,
+* per-sphere material and emission, the light alias table) and drawing from
+* the same per-sample PCG streams as the independent sampler. The film's
+* sums and pixel statistics go to the device and come back with the pass.
+* Scenes and settings the kernel does not cover, or a machine without an
+* offload device, fall back to the host renderers. Device passes are not
+* counted in the render statistics.
+*/
+
+// Why the offload kernel cannot render the current scene and settings, or null
+const char *offloadUnsupported() {
+	if (numMeshes) return "triangle meshes";
+	if (settings.sampler != SAMPLER_INDEPENDENT) return "--sampler sobol and bluenoise";
+	if (settings.lightSampling != LIGHT_AREA) return "--light cone";
+	if (settings.lightSelect != LIGHTS_POWER) return "--lightselect bvh";
+	if (settings.cacheCell > 0) return "--cache";
+	if (settings.causticPhotons > 0) return "--caustics";
+	return 0;
+}
+
+// Scene arrays as the kernel sees them, device pointers inside the region
+struct DeviceScene {
+	const BVHNode *nodes;
+	const double *cx, *cy, *cz, *r2;    // spheres in BVH leaf order
+	const int *leafIds;                 // leaf order -> sphere id
+	const double *spheres;              // per sphere id: p, rad, e, k
+	const int *types;                   // per sphere id: BRDFType
+	const int *lightIds, *alias, *lightOf;
+	const double *pmf, *aliasProb;
+	int numLights, maxDepth, rrDepth;
+	bool mis;
+};
+
+enum { deviceSphereDoubles = 10 };
+
+#pragma omp declare target
+// BVH::intersect() and BVH::occluded() in one: with any set, whether
+// anything lies in (eps, tmax); otherwise the closest hit
+inline bool deviceTrace(const DeviceScene &s, const Ray &r, double tmax, bool any, double &t, int &id) {
+	const double eps = 1e-4;
+	const double o[3] = { r.o.x, r.o.y, r.o.z };
+	const double inv[3] = { 1.0 / r.d.x, 1.0 / r.d.y, 1.0 / r.d.z };
+	double tHit = tmax;
+	int idHit = -1;
+	int stack[BVH::stackSize], sp = 0, cur = 0;
+	for (;;) {
+		const BVHNode &node = s.nodes[cur];
+		double t0 = 0, t1 = tHit;
+		for (int a = 0; a < 3; ++a) {
+			double tn = (node.lo[a] - o[a]) * inv[a], tf = (node.hi[a] - o[a]) * inv[a];
+			t0 = std::max(t0, std::min(tn, tf));
+			t1 = std::min(t1, std::max(tn, tf));
+		}
+		if (t0 <= t1) {
+			if (node.leaf()) {
+				for (int i = node.offset, e = node.offset + node.count; i < e; ++i) {
+					double px = s.cx[i] - r.o.x, py = s.cy[i] - r.o.y, pz = s.cz[i] - r.o.z;
+					double b = px*r.d.x + py*r.d.y + pz*r.d.z, det = b*b - (px*px + py*py + pz*pz) + s.r2[i];
+					if (det < 0) continue;
+					det = std::sqrt(det);
+					if (any) {
+						if ((b - det > eps && b - det < tmax) || (b + det > eps && b + det < tmax)) return true;
+						continue;
+					}
+					double d = b - det > eps ? b - det : b + det > eps ? b + det : 0;
+					if (d && d < tHit) { tHit = d; idHit = s.leafIds[i]; }
+				}
+				if (!sp) break;
+				cur = stack[--sp];
+			}
+			else if (!any && inv[node.axis] < 0) {
+				stack[sp++] = cur + 1;
+				cur = node.offset;
+			}
+			else {
+				stack[sp++] = node.offset;
+				cur = cur + 1;
+			}
+		}
+		else {
+			if (!sp) break;
+			cur = stack[--sp];
+		}
+	}
+	if (any || idHit < 0) return false;
+	t = tHit;
+	id = idHit;
+	return true;
+}
+
+// receivedRadiance() for spheres, area light sampling and lights picked by
+// power, consuming rng in the same order as the independent sampler
+inline Vec deviceRadiance(const DeviceScene &s, Ray ray, RNG &rng) {
+	Vec L, beta(1, 1, 1);
+	Real prevPdf = 0;
+	bool flag = true;
+
+	for (int depth = 1; ; ++depth) {
+		double t;
+		int id = 0;
+		if (!deviceTrace(s, ray, 1e20, false, t, id)) break;
+
+		const double *sp = s.spheres + deviceSphereDoubles * id;
+		Vec x = ray.o + ray.d*t;
+		Vec o = (Vec() - ray.d).normalize();
+		Vec n = (x - Vec(sp[0], sp[1], sp[2])).normalize();
+		if (n.dot(o) < 0) n = n*-1.0;
+		x = spawnOrigin(x, n);
+		const Vec e(sp[4], sp[5], sp[6]), k(sp[7], sp[8], sp[9]);
+		const bool specular = s.types[id] == BRDF_SPECULAR;
+		const Frame frame(n);
+
+		if (flag) L = L + beta.mult(e);
+		else if (s.mis && prevPdf > 0 && s.lightOf[id] >= 0) {
+			// lightPdf() for area sampling
+			Vec d = x - ray.o;
+			Real dist2 = d.dot(d), cosLight = std::abs(n.dot(d)) / std::sqrt(dist2);
+			Real pdf = cosLight > 0 ? s.pmf[s.lightOf[id]] * dist2 / (cosLight * 4.0 * PI * sp[3] * sp[3]) : 0;
+			L = L + beta.mult(e) * powerHeuristic(prevPdf, pdf);
+		}
+
+		if (!specular && s.numLights) {
+			// sampleDirect(): alias table pick, then a uniform point on the light
+			double scaled = rng() * s.numLights;
+			int li = std::min(int(scaled), s.numLights - 1);
+			if (scaled - li >= s.aliasProb[li]) li = s.alias[li];
+			if (s.lightIds[li] != id) {
+				const double *lp = s.spheres + deviceSphereDoubles * s.lightIds[li];
+				double e1 = rng(), e2 = rng();
+				Real r = lp[3],
+					z = 2.0 * e1 - 1.0,
+					lx = sqrt(1.0 - (z * z)) * cos(2.0 * PI * e2),
+					ly = sqrt(1.0 - (z * z)) * sin(2.0 * PI * e2);
+				Vec ln(lx, ly, z), y1 = Vec(lp[0], lp[1], lp[2]) + ln * r;
+				Real pdf1 = 1 / (4.0 * PI * (r * r));
+				Real r2 = (x - y1).dot(x - y1), dist = std::sqrt(r2);
+				Vec dir = (y1 - x) * (1.0 / dist);
+				Real cosLight = ln.dot(dir * -1), cosSurf = n.dot(dir);
+				if (cosLight > 0 && cosSurf > 0) {
+					pdf1 *= r2 / cosLight;
+					pdf1 *= s.pmf[li];
+					Vec contrib = Vec(lp[4], lp[5], lp[6]).mult(k * (1.0 / PI)) * (cosSurf / pdf1);
+					if (s.mis) contrib = contrib * powerHeuristic(pdf1, std::max<Real>(0, n.dot(dir)) / PI);
+					double tShadow;
+					int idShadow;
+					if (!deviceTrace(s, Ray(x, dir), dist - shadowGap, true, tShadow, idShadow))
+						L = L + beta.mult(contrib);
+				}
+			}
+		}
+
+		if (depth >= s.maxDepth) break;
+
+		Real p = 1.0;
+		if (depth >= s.rrDepth) {
+			p = std::min<Real>(0.95, std::max(beta.x, std::max(beta.y, beta.z)));
+			if (p <= 0 || rng() >= p) break;
+		}
+
+		Vec i, fr;
+		Real pdf;
+		if (specular) {
+			BRDFKernel<BRDF_SPECULAR>::mirroredDirection(n, o, i);
+			pdf = 1.0;
+			fr = BRDFKernel<BRDF_SPECULAR>::eval(k, frame, o, i);
+		}
+		else {
+			// uniformRandomPSA()
+			double u1 = rng(), u2 = rng();
+			Real z = sqrt(u1), r = sqrt(1.0 - z * z), phi = 2.0 * PI * u2;
+			i = frame.toWorld(r * cos(phi), r * sin(phi), z);
+			pdf = z / PI;
+			fr = k * (1.0 / PI);
+		}
+		if (pdf <= 0) break;
+
+		beta = beta.mult(fr) * (n.dot(i) / (pdf * p));
+		ray = Ray(x, i);
+		flag = specular;
+		prevPdf = specular ? 0 : pdf;
+	}
+	return L;
+}
+#pragma omp end declare target
+
+// renderMegakernel() as a target region on OpenMP device `device`. Stream
+// and checkpoint see the whole frame as one tile once the pass is back.
+void renderOffload(int device, Film &film, int samps, const std::vector<char> *active, ImageStream *stream,
+	Checkpoint *checkpoint, const Vec &cx, const Vec &cy) {
+	const int w = film.w, h = film.h, n = w * h;
+
+	// Film state, flat: sums, the pixel statistics and each pixel's samples this pass
+	std::vector<float> sums(3 * size_t(n));
+	std::vector<int> counts(n), todo(n);
+	std::vector<double> means(n), m2s(n);
+	for (int i = 0; i < n; ++i) {
+		const Vec v = film.sum(i);
+		sums[3 * i] = float(v.x);
+		sums[3 * i + 1] = float(v.y);
+		sums[3 * i + 2] = float(v.z);
+		counts[i] = film.stats[i].n;
+		means[i] = film.stats[i].mean;
+		m2s[i] = film.stats[i].m2;
+		todo[i] = !ownsPixel(w, h, i) ? 0 : active ? ((*active)[i] ? samps : 0) :
+			std::max(0, film.samples + samps - counts[i]);
+	}
+
+	// Scene, flat
+	std::vector<double> spheresFlat(deviceSphereDoubles * size_t(std::max(numSpheres, 1)));
+	std::vector<int> types(std::max(numSpheres, 1));
+	for (int i = 0; i < numSpheres; ++i) {
+		const Sphere &sp = spheres[i];
+		const double v[deviceSphereDoubles] = { sp.p.x, sp.p.y, sp.p.z, sp.rad, sp.e.x, sp.e.y, sp.e.z,
+			sp.brdf.k.x, sp.brdf.k.y, sp.brdf.k.z };
+		std::copy(v, v + deviceSphereDoubles, &spheresFlat[deviceSphereDoubles * i]);
+		types[i] = sp.brdf.type;
+	}
+	std::vector<int> lightIds(lights.ids), alias(lights.alias), lightOf(lights.index);
+	std::vector<double> pmf(lights.pmf), aliasProb(lights.aliasProb);
+	const int numLights = lights.size();
+	lightIds.resize(std::max(numLights, 1));
+	alias.resize(std::max(numLights, 1));
+	pmf.resize(std::max(numLights, 1));
+	aliasProb.resize(std::max(numLights, 1));
+	lightOf.resize(std::max(numSpheres, 1), -1);
+
+	const BVHNode *nodes = &bvh.nodes[0];
+	const double *bx = &bvh.soa.cx[0], *by = &bvh.soa.cy[0], *bz = &bvh.soa.cz[0], *br2 = &bvh.soa.r2[0];
+	const int *leafIds = &bvh.soa.ids[0], *typesP = &types[0], *lightIdsP = &lightIds[0], *aliasP = &alias[0],
+		*lightOfP = &lightOf[0], *todoP = &todo[0];
+	const double *spheresP = &spheresFlat[0], *pmfP = &pmf[0], *aliasProbP = &aliasProb[0];
+	float *sumsP = &sums[0];
+	int *countsP = &counts[0];
+	double *meansP = &means[0], *m2sP = &m2s[0];
+	const int numNodes = int(bvh.nodes.size()), numLeaf = int(bvh.soa.ids.size()), numIds = int(types.size()),
+		numLightSlots = int(lightIds.size());
+	const int maxDepth = settings.maxDepth, rrDepth = settings.rrDepth, firstSample = cluster.firstSample;
+	const bool mis = settings.mis;
+	const uint64_t seed = settings.seed;
+	const Vec camO = cam.o, camD = cam.d;
+
+#pragma omp target teams distribute parallel for schedule(static, 1) device(device) \
+	map(to: nodes[0:numNodes], bx[0:numLeaf], by[0:numLeaf], bz[0:numLeaf], br2[0:numLeaf], leafIds[0:numLeaf], \
+		spheresP[0:deviceSphereDoubles * numIds], typesP[0:numIds], lightOfP[0:numIds], \
+		lightIdsP[0:numLightSlots], aliasP[0:numLightSlots], pmfP[0:numLightSlots], aliasProbP[0:numLightSlots], \
+		todoP[0:n]) \
+	map(tofrom: sumsP[0:3 * n], countsP[0:n], meansP[0:n], m2sP[0:n])
+	for (int i = 0; i < n; ++i) {
+		DeviceScene s;
+		s.nodes = nodes;
+		s.cx = bx; s.cy = by; s.cz = bz; s.r2 = br2;
+		s.leafIds = leafIds;
+		s.spheres = spheresP;
+		s.types = typesP;
+		s.lightIds = lightIdsP; s.alias = aliasP; s.lightOf = lightOfP;
+		s.pmf = pmfP; s.aliasProb = aliasProbP;
+		s.numLights = numLights;
+		s.maxDepth = maxDepth;
+		s.rrDepth = rrDepth;
+		s.mis = mis;
+
+		const int x = i % w, y = h - 1 - i / w;
+		for (int k = 0; k < todoP[i]; ++k) {
+			Vec pixel;
+			for (int sub = 0; sub < 4; ++sub) {
+				RNG rng = sampleRNG(seed, i, subpixelSample(sub, firstSample + countsP[i]));
+				// cameraRay()
+				double r1 = rng() * 2, r2 = rng() * 2;
+				double dx = r1<1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+				double dy = r2<1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+				Vec d = cx*((((sub & 1) + .5 + dx) / 2 + x) / w - .5) +
+					cy*((((sub >> 1) + .5 + dy) / 2 + y) / h - .5) + camD;
+				pixel = pixel + deviceRadiance(s, Ray(camO, d.normalize()), rng);
+			}
+			pixel = pixel * .25;
+			sumsP[3 * i] += float(pixel.x);
+			sumsP[3 * i + 1] += float(pixel.y);
+			sumsP[3 * i + 2] += float(pixel.z);
+			// PixelStats::add()
+			const double lum = luminance(pixel);
+			const int c = ++countsP[i];
+			const double delta = lum - meansP[i];
+			meansP[i] += delta / c;
+			m2sP[i] += delta * (lum - meansP[i]);
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		const size_t o = film.offset(i);
+		film.plane(0)[o] = sums[3 * i];
+		film.plane(1)[o] = sums[3 * i + 1];
+		film.plane(2)[o] = sums[3 * i + 2];
+		film.stats[i].n = counts[i];
+		film.stats[i].mean = means[i];
+		film.stats[i].m2 = m2s[i];
+	}
+	Tile frame = { 0, 0, w, h };
+	if (stream) stream->tileDone(film, frame);
+	if (checkpoint) checkpoint->tileDone(film, frame);
+	fprintf(stderr, "Rendered %d spp on device %d%s\n", (film.samples + samps) * 4, device,
+		device == omp_get_initial_device() ? " (the host)" : "");
+}
+
+// Device renderPass() sends passes to, or -1 for the host renderers. Says
+// why once, when --device gpu cannot be honoured.
+int offloadDevice() {
+	static bool warned = false;
+	if (settings.device != DEVICE_GPU) return -1;
+	const char *why = omp_get_num_devices() == 0 ? "no offload device" : offloadUnsupported();
+	if (!why) return omp_get_default_device();
+	if (!warned) fprintf(stderr, "--device gpu: %s; rendering on the host\n", why);
+	warned = true;
+	return -1;
+}
+
+// Adds 4 * samps samples per pixel of the fixed camera to film, or only to
+// the pixels set in active. Finished tiles go to stream and checkpoint, if
+// given.
+void renderPass(Film &film, int samps, const std::vector<char> *active = 0, ImageStream *stream = 0,
+	Checkpoint *checkpoint = 0) {
+	Vec cx, cy;
+	cam.axes(film.w, film.h, cx, cy);
+	const int device = offloadDevice();
+	if (device >= 0) renderOffload(device, film, samps, active, stream, checkpoint, cx, cy);
+	else if (settings.wavefront) renderWavefront(film, samps, active, stream, checkpoint, cx, cy);
+	else renderMegakernel(film, samps, active, stream, checkpoint, cx, cy);
+	if (!active) film.samples += samps;
+}
+
+// Sets film.samples, after loading a checkpoint, to the samples per subpixel
+// every pixel of ours has reached, and returns whether they all stopped
+// there. taken receives the subpixel samples already in film.
+bool resumeFilm(Film &film, double &taken) {
+	int least = -1;
+	bool even = true;
+	taken = 0;
+	for (int i = 0; i < film.w * film.h; ++i) {
+		if (!ownsPixel(film.w, film.h, i)) continue;
+		const int n = film.stats[i].n;
+		if (least >= 0 && n != least) even = false;
+		if (least < 0 || n < least) least = n;
+		taken += n;
+	}
+	film.samples = std::max(least, 0);
+	if (taken > 0) fprintf(stderr, "Resuming at %d spp%s\n", film.samples * 4, even ? "" : " (some pixels ahead)");
+	return even;
+}
+
+// Renders the fixed camera at w x h with 4 * samps samples per pixel into c,
+// optionally streaming it to streamPath as tiles finish; partialPath, if
+// given, receives the accumulation buffer. With checkpointPath the render
+// resumes from, and keeps updating, that checkpoint. c is denoised if the
+// denoise settings ask for it. Reports its own write errors, and leaves c
+// empty if the checkpoint cannot be used.
+bool renderImage(int w, int h, int samps, std::vector<Vec> &c, const char *streamPath = 0,
+	const char *partialPath = 0, const char *checkpointPath = 0) {
+	prepareCaches();
+	Film film(w, h);
+	Checkpoint checkpoint;
+	c.clear();
+	if (checkpointPath) {
+		if (!checkpoint.open(checkpointPath, film, output.checkpointInterval)) return false;
+		double taken;
+		resumeFilm(film, taken);
+	}
+	ImageStream stream;
+	bool ok = !streamPath || stream.open(streamPath, film);
+	renderPass(film, std::max(0, samps - film.samples), 0, streamPath && ok ? &stream : 0,
+		checkpointPath ? &checkpoint : 0);
+	film.resolve(c);
+	bool denoised = denoiseImage(film, output.path, c);   // reports its own errors
+	if (!stream.close() || !ok) {
+		fprintf(stderr, "Cannot write %s\n", streamPath);
+		ok = false;
+	}
+	if (partialPath && !writePartial(partialPath, film)) {
+		fprintf(stderr, "Cannot write %s\n", partialPath);
+		ok = false;
+	}
+	if (!checkpoint.close()) {
+		fprintf(stderr, "Cannot write %s\n", checkpointPath);
+		ok = false;
+	}
+	return ok && denoised;
+}
+
+
+/*
+* Progressive rendering
+*
+* Passes of 1, 1, 2, 4, ... samples per subpixel double the film each time,
+* and the image is rewritten after every pass. Because each pass after the
+* first holds as many samples as all earlier ones, the two halves give an
+* independent estimate of the remaining noise.
+*/
+
+// Writes c to path through a temporary file, so an interrupted run leaves the
+// previous pass's image rather than a truncated one
+void replaceImage(const char *path, int w, int h, const std::vector<Vec> &c) {
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.part", path);
+	if (!writeImage(tmp, isPFM(path), w, h, c)) {
+		fprintf(stderr, "Cannot write %s\n", tmp);
+		return;
+	}
+	replaceFile(tmp, path);
+}
+
+// RMSE in 8-bit display units of film, given the sums its first half of the
+// samples (film.samples / 2 per subpixel) had reached. The mean of two
+// independent halves has half the RMS of their difference.
+double estimateNoise(const Film &film, const std::vector<Vec> &firstHalf) {
+	const double n = film.samples / 2;
+	double sum = 0;
+	int pixels = 0;
+	for (int i = 0; i < film.w * film.h; ++i) {
+		if (!ownsPixel(film.w, film.h, i)) continue;
+		++pixels;
+		Vec a = firstHalf[i] * (1 / n), b = (film.sum(i) - firstHalf[i]) * (1 / n);
+		Vec d = Vec(toInt(a.x), toInt(a.y), toInt(a.z)) - Vec(toInt(b.x), toInt(b.y), toInt(b.z));
+		sum += d.dot(d);
+	}
+	return 0.5 * std::sqrt(sum / (3.0 * std::max(pixels, 1)));
+}
+
+// Samples per subpixel every pixel gets before adaptive passes trust its
+// variance estimate
+const int adaptiveBaseSamples = 4;
+
+// Renders passes until the time budget or noise target in settings is met,
+// or maxSamps samples per subpixel are reached, leaving the image in c and
+// rewriting path (if not null) after every pass. With settings.adaptiveError
+// set, passes after the first adaptiveBaseSamples go only to pixels whose
+// relative error is above it. checkpointPath is as for renderImage(); the
+// time budget counts this run only. Only the final image is denoised.
+// Returns the average spp in the image, or -1 if the checkpoint cannot be
+// used.
+double renderProgressive(int w, int h, int maxSamps, const char *path, std::vector<Vec> &c,
+	const char *partialPath = 0, const char *checkpointPath = 0) {
+	prepareCaches();
+	Film film(w, h);
+	std::vector<Vec> firstHalf;
+	std::vector<char> active;
+	const bool adaptive = settings.adaptiveError > 0;
+	double taken = 0;   // subpixel samples so far, summed over pixels
+	double resumed = 0; // of those, the ones loaded from the checkpoint
+	bool even = true;   // every pixel has film.samples, so a pass can be halved
+	Checkpoint checkpoint;
+	if (checkpointPath) {
+		if (!checkpoint.open(checkpointPath, film, output.checkpointInterval)) return -1;
+		even = resumeFilm(film, resumed);
+	}
+	const double t0 = omp_get_wtime();
+	int owned = 0;      // pixels this process renders
+	for (int i = 0; i < w * h; ++i) owned += ownsPixel(w, h, i);
+
+	for (int samps = 1; ; samps *= 2) {
+		const bool uniform = !adaptive || film.samples < adaptiveBaseSamples;
+		int pixels = owned;
+		if (uniform) {
+			if (film.samples >= maxSamps) break;
+			// the run's first pass is one sample, to measure the cost of one
+			samps = std::min(taken > 0 ? std::max(1, film.samples) : 1, maxSamps - film.samples);
+		}
+		else {
+			pixels = 0;
+			active.assign(w * h, 0);
+			for (int i = 0; i < w * h; ++i)
+				if (ownsPixel(w, h, i) && film.stats[i].n < maxSamps &&
+					film.stats[i].relativeError() > settings.adaptiveError) {
+					active[i] = 1;
+					++pixels;
+				}
+			if (!pixels) break;
+		}
+
+		// Predict the pass from the cost per sample so far
+		const double elapsed = omp_get_wtime() - t0;
+		if (settings.timeBudget > 0 && taken > 0 &&
+			elapsed + elapsed / taken * pixels * samps > settings.timeBudget)
+			break;
+
+		const bool halves = uniform && !adaptive && even && samps == film.samples;
+		if (halves && settings.noiseTarget > 0) film.sums(firstHalf);
+		renderPass(film, samps, uniform ? 0 : &active, 0, checkpointPath ? &checkpoint : 0);
+		taken += double(pixels) * samps;
+		if (uniform && !even) {
+			even = true;
+			for (int i = 0; i < w * h; ++i)
+				if (ownsPixel(w, h, i) && film.stats[i].n != film.samples) even = false;
+		}
+		film.resolve(c);
+		if (path) replaceImage(path, w, h, c);
+		if (partialPath && !writePartial(partialPath, film)) fprintf(stderr, "Cannot write %s\n", partialPath);
+
+		fprintf(stderr, "Pass done: %.1f spp", 4 * (resumed + taken) / std::max(owned, 1));
+		if (!uniform) fprintf(stderr, " (%.1f%% of pixels sampled)", 100. * pixels / std::max(owned, 1));
+		fprintf(stderr, ", %.2f s", omp_get_wtime() - t0);
+		if (halves && settings.noiseTarget > 0) {
+			double noise = estimateNoise(film, firstHalf);
+			fprintf(stderr, ", estimated rmse %.2f\n", noise);
+			if (noise < settings.noiseTarget) break;
+		}
+		else fprintf(stderr, "\n");
+	}
+	film.resolve(c);   // a resumed render may have had nothing left to do
+	if ((denoise.enabled || denoise.hook) && denoiseImage(film, output.path, c) && path) replaceImage(path, w, h, c);
+	if (!checkpoint.close()) fprintf(stderr, "Cannot write %s\n", checkpointPath);
+	return 4 * (resumed + taken) / std::max(owned, 1);
+}
+
+
+/*
+* Animation
+*
+* --frames N renders N frames with the camera moved by --pan every frame,
+* written to the output path with the frame number before its extension.
+* With --reproject each frame starts from the previous one's samples:
+* every pixel's first surface (through its centre) is projected into the
+* previous frame, and where the pixel there saw the same primitive at the
+* same point, its accumulated samples are carried over. Such pixels then
+* take only the samples that top them up to the frame's spp, and at least a
+* quarter of it so that history keeps being replaced. Mirrors and misses
+* never reuse history, as their radiance depends on the view.
+*/
+
+struct AnimationSettings {
+	int frames;         // 0 for a single image
+	Vec pan;            // camera move per frame
+	bool reproject;
+
+	AnimationSettings() : frames(0), reproject(false) {}
+} animation;
+
+// Surface seen through the centre of a pixel
+struct FirstHit {
+	Vec p;
+	int id;             // -1 for a miss or a mirror
+};
+
+// Path of frame k: path with _kkkk before its extension
+std::string framePath(const char *path, int k) {
+	std::string p = path;
+	size_t dot = p.rfind('.'), slash = p.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = p.size();
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", k);
+	return p.insert(dot, number);
+}
+
+// Camera of frame k
+Camera frameCamera(const Camera &start, int k) {
+	Camera c = start;
+	c.o = start.o + animation.pan * double(k);
+	return c;
+}
+
+void firstHits(const Vec &cx, const Vec &cy, int w, int h, std::vector<FirstHit> &hits) {
+	hits.resize(w * h);
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x) {
+			FirstHit &hit = hits[(h - y - 1) * w + x];
+			const Ray r(cam.o, (cx*((x + .5) / w - .5) + cy*((y + .5) / h - .5) + cam.d).normalize());
+			double t;
+			int id = 0;
+			hit.id = -1;
+			if (intersect(r, t, id) && !primitiveBRDF(id).isSpecular()) {
+				hit.p = r.o + r.d*t;
+				hit.id = id;
+			}
+		}
+}
+
+// Continuous pixel coordinates (x right, y up, as in cameraRay()) at which
+// camera c with axes cx, cy sees p; false if p is behind it
+bool projectPoint(const Camera &c, const Vec &cx, const Vec &cy, int w, int h, const Vec &p, double &px,
+	double &py) {
+	// p - c.o = s * (cx * u + cy * v + c.d), solved by Cramer's rule
+	const Vec o = p - c.o, cyd = cy.cross(c.d);
+	const double det = cx.dot(cyd);
+	if (det == 0) return false;
+	const double s = cx.dot(cy.cross(o)) / det;
+	if (s <= 0) return false;
+	px = (o.dot(cyd) / det / s + .5) * w - .5;
+	py = (cx.dot(o.cross(c.d)) / det / s + .5) * h - .5;
+	return true;
+}
+
+// Copies into the empty film, for every pixel whose first hit the previous
+// frame (prev, rendered by prevCam with first hits prevHits) saw too, that
+// pixel's samples, scaled down to at most cap. Returns the pixels reused.
+int reprojectFilm(const Film &prev, const Camera &prevCam, const std::vector<FirstHit> &prevHits,
+	const std::vector<FirstHit> &hits, int cap, Film &film) {
+	const int w = film.w, h = film.h;
+	const double tolerance = 0.01;   // of the distance to the previous camera
+	Vec cx, cy;
+	prevCam.axes(w, h, cx, cy);
+	int reused = 0;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:reused)
+	for (int i = 0; i < w * h; ++i) {
+		const FirstHit &hit = hits[i];
+		double px, py;
+		if (hit.id < 0 || !projectPoint(prevCam, cx, cy, w, h, hit.p, px, py)) continue;
+		const int x = int(std::floor(px + .5)), y = int(std::floor(py + .5));
+		if (x < 0 || x >= w || y < 0 || y >= h) continue;
+		const int j = (h - y - 1) * w + x;
+		const Vec d = prevHits[j].p - hit.p, v = hit.p - prevCam.o;
+		const PixelStats &s = prev.stats[j];
+		if (prevHits[j].id != hit.id || d.dot(d) > tolerance * tolerance * v.dot(v) || s.n == 0) continue;
+		const int n = std::min(s.n, cap);
+		const double scale = double(n) / s.n;
+		film.add(i, prev.sum(j) * scale);
+		film.stats[i].n = n;
+		film.stats[i].mean = s.mean;
+		film.stats[i].m2 = s.m2 * scale;
+		++reused;
+	}
+	return reused;
+}
+
+// Renders the animation settings' frames from the current camera at
+// 4 * samps spp each, writing frame k to framePath(path, k) if path is not
+// null, and leaves the last frame in c. Returns the new samples per pixel a
+// frame took on average, or -1 if a frame could not be written.
+double renderAnimation(int w, int h, int samps, const char *path, std::vector<Vec> &c) {
+	const Camera start = cam;
+	const ClusterSettings savedCluster = cluster;
+	const int fresh = std::max(1, samps / 4);
+	prepareCaches();
+	Film film(w, h), prev(w, h);
+	std::vector<FirstHit> hits, prevHits;
+	double taken = 0;   // new subpixel samples, summed over pixels and frames
+	bool ok = true;
+	for (int k = 0; k < animation.frames; ++k) {
+		const double t0 = omp_get_wtime();
+		cam = frameCamera(start, k);
+		film.clear();
+		int reused = 0;
+		double before = 0;
+		if (animation.reproject) {
+			Vec cx, cy;
+			cam.axes(w, h, cx, cy);
+			firstHits(cx, cy, w, h, hits);
+			if (k > 0) reused = reprojectFilm(prev, frameCamera(start, k - 1), prevHits, hits, samps - fresh, film);
+			for (int i = 0; i < w * h; ++i) before += film.stats[i].n;
+		}
+		cluster.firstSample = savedCluster.firstSample + k * samps;   // no index repeats across frames
+		renderPass(film, samps);
+		taken += double(w) * h * samps - before;
+		film.resolve(c);
+		const std::string frame = path ? framePath(path, k) : std::string();
+		if (!denoiseImage(film, path ? frame.c_str() : output.path, c)) ok = false;
+		if (path && !writeImage(frame.c_str(), isPFM(path), w, h, c)) {
+			fprintf(stderr, "Cannot write %s\n", frame.c_str());
+			ok = false;
+		}
+		fprintf(stderr, "\rFrame %d: %.1f%% of pixels reused, %.1f new spp, %.2f s\n", k,
+			100. * reused / (w * h), 4 * (double(w) * h * samps - before) / (w * h), omp_get_wtime() - t0);
+		std::swap(film, prev);
+		prevHits.swap(hits);
+	}
+	cam = start;
+	cluster = savedCluster;
+	return ok ? 4 * taken / (double(w) * h * std::max(animation.frames, 1)) : -1;
+}
+
+
+/*
+* Library interface
+*
+* Building with -DSIMPLEPT_NO_MAIN leaves main() out, so a program can
+* compile this file in and keep one Renderer for a whole session: the
+* scene, its BVH and the film stay alive between frames, and OpenMP keeps
+* its thread team parked between parallel regions, so a frame costs only
+* its samples. A camera move rebuilds nothing; a material edit only resets
+* the radiance cache and caustic map before the next frame. The renderer
+* drives the same globals as main(), so a process has at most one.
+*/
+
+struct Renderer {
+	// Called after every pass with the frame so far (linear RGB, rows top to
+	// bottom) and its samples per pixel; returning false ends the frame there
+	typedef bool (*Callback)(const Vec *image, int w, int h, int spp, void *user);
+
+	Renderer(int w_ = 480, int h_ = 360) : film(w_, h_), loaded(false), stale(true) {}
+
+	// Replaces the scene by a text or binary scene file, or by the built-in
+	// Cornell box if path is null
+	bool load(const char *path = 0) {
+		Scene s;
+		BVH accel;
+		if (path ? !loadScene(path, s, accel) : !parseScene("cornellBox", cornellBox, s)) return false;
+		if (!path) buildBVH(s, accel);
+		std::swap(scene, s);
+		std::swap(bvh, accel);
+		useScene();
+		bindThreads();
+		film = Film(film.w, film.h);   // first touched by the bound threads
+		loaded = stale = true;
+		return true;
+	}
+
+	int materials() const { return int(scene.materials.size()); }
+
+	// Material k of the scene, to edit between frames; the spheres and
+	// triangles using it see the change
+	BRDF &material(int k) {
+		stale = true;
+		return scene.materials[k];
+	}
+
+	void resize(int w, int h) {
+		if (w != film.w || h != film.h) film = Film(w, h);
+	}
+
+	// Renders camera at spp samples per pixel (a multiple of 4, rounded up)
+	// into out, w * h pixels as for resize(), in passes of 1, 1, 2, 4, ...
+	// samples per subpixel. Denoises the last pass if the denoise settings
+	// ask for it. Returns the spp reached, or -1 without a scene.
+	int render(const Camera &camera, int spp, Vec *out, Callback callback = 0, void *user = 0) {
+		if (!loaded) return -1;
+		if (stale) prepareCaches();
+		stale = false;
+		cam = camera;
+		film.clear();
+		const int samps = std::max(1, (spp + 3) / 4);
+		while (film.samples < samps) {
+			renderPass(film, std::min(std::max(1, film.samples), samps - film.samples));
+			film.resolve(image);
+			if (film.samples == samps) denoiseImage(film, output.path, image);
+			std::copy(image.begin(), image.end(), out);
+			if (callback && !callback(out, film.w, film.h, film.samples * 4, user)) break;
+		}
+		return film.samples * 4;
+	}
+
+	Film film;
+	std::vector<Vec> image;   // resolved film, kept to avoid reallocating
+	bool loaded;
+	bool stale;               // the caches predate the last scene or material change
+};
+
+
+/*
+* Benchmarks
+*/
+
+const char *referenceImage = "image_256_samples.ppm";
+
+const DiffuseBRDF benchSurf(Vec(.75, .75, .75));
+
+// Random sphere soup inside the Cornell box volume, radii shrinking with count
+std::vector<Sphere> randomSpheres(int n, std::mt19937 &gen) {
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<Sphere> s;
+	s.reserve(n);
+	double rad = 40.0 / std::cbrt(double(n));
+	for (int i = 0; i < n; ++i)
+		s.push_back(Sphere(rad * (0.25 + 0.75 * u(gen)),
+			Vec(100 * u(gen), 80 * u(gen), 170 * u(gen)), Vec(), benchSurf));
+	return s;
+}
+
+volatile double benchSink;   // keeps benchmarked results observable
+
+// Rays per second of fn over a fixed ray set, run for at least `seconds`
+template <class F>
+double raysPerSecond(const std::vector<Ray> &rays, double seconds, F fn) {
+	long long count = 0;
+	double t0 = omp_get_wtime(), t1, sum = 0;
+	do {
+		for (size_t i = 0; i < rays.size(); ++i) {
+			double t = 0;
+			int id = 0;
+			if (fn(rays[i], t, id)) sum += t + id;
+		}
+		count += rays.size();
+		benchSink = sum;
+	} while ((t1 = omp_get_wtime()) - t0 < seconds);
+	return count / (t1 - t0);
+}
+
+void benchBVH() {
+	std::mt19937 gen(1234);
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+
+	std::vector<Ray> rays;
+	for (int i = 0; i < 4096; ++i) {
+		Vec d(u(gen) - .5, u(gen) - .5, u(gen) - .5);
+		rays.push_back(Ray(Vec(100 * u(gen), 80 * u(gen), 170 * u(gen)), d.normalize()));
+	}
+
+	printf("%10s %16s %16s %10s\n", "spheres", "linear Mrays/s", "bvh Mrays/s", "speedup");
+	for (int n = 4; n <= 32768; n *= 4) {
+		// The first row is the Cornell box itself
+		std::vector<Sphere> scene = n == 4 ? std::vector<Sphere>(spheres, spheres + numSpheres) :
+			randomSpheres(n, gen);
+		n = int(scene.size());
+		BVH accel;
+		double tb = omp_get_wtime();
+		accel.build(&scene[0], n);
+		tb = omp_get_wtime() - tb;
+
+		double lin = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+			return intersectLinear(&scene[0], n, r, t, id); });
+		double acc = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+			return accel.intersect(r, t, id); });
+		printf("%10d %16.3f %16.3f %9.1fx   (build %.2f ms, %d nodes)\n",
+			n, lin * 1e-6, acc * 1e-6, acc / lin, tb * 1e3, int(accel.nodes.size()));
+	}
+}
+
+// Ray-sphere tests per second for the AoS loop and each SoA kernel level
+void benchIntersect() {
+	const int nspheres = 64, nrays = 1024;
+	std::mt19937 gen(4321);
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<Sphere> scene = randomSpheres(nspheres, gen);
+	SphereSoA soa;
+	soa.assign(&scene[0], 0, nspheres);
+
+	std::vector<Ray> rays;
+	for (int i = 0; i < nrays; ++i) {
+		Vec d(u(gen) - .5, u(gen) - .5, u(gen) - .5);
+		rays.push_back(Ray(Vec(100 * u(gen), 80 * u(gen), 170 * u(gen)), d.normalize()));
+	}
+
+	double aos = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+		return intersectLinear(&scene[0], nspheres, r, t, id); });
+	printf("%-12s %12.1f Misect/s\n", "aos", aos * nspheres * 1e-6);
+
+	for (int level = SIMD_SCALAR; level <= bestSimdLevel(); ++level) {
+		double rate = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+			t = 1e20; return hitSpheres(level, soa, 0, nspheres, r, t, id); });
+		printf("%-12s %12.1f Misect/s\n", simdLevelName(level), rate * nspheres * 1e-6);
+	}
+}
+
+// RMSE against the reference render as spp grows, for each sampler (CSV)
+void benchSampler() {
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	RenderSettings saved = settings;
+	printf("sampler,spp,seconds,rmse\n");
+	for (int type = SAMPLER_INDEPENDENT; type <= SAMPLER_BLUENOISE; ++type) {
+		settings.sampler = type;
+		for (int spp = 4; spp <= 64; spp *= 2) {
+			double t0 = omp_get_wtime();
+			renderImage(w, h, spp / 4, c);
+			double t = omp_get_wtime() - t0;
+			printf("%s,%d,%.3f,%.4f\n", samplerName(type), spp, t, displayRMSE(c, ref));
+			fflush(stdout);
+		}
+	}
+	settings = saved;
+}
+
+// Direct-lighting variance per light-sampling strategy at a fixed set of
+// diffuse camera-ray hits, normalized to equal time (variance * seconds)
+void benchLightSampling() {
+	const int w = 120, h = 90, nsamples = 256;
+	Vec cx, cy;
+	cam.axes(w, h, cx, cy);
+
+	struct ShadingPoint { int id; Vec x, n, o; };
+	std::vector<ShadingPoint> points;
+	Sampler sampler(SAMPLER_INDEPENDENT, 99);
+	for (int y = 0; y < h; ++y)
+		for (int x = 0; x < w; ++x) {
+			sampler.startSample(x, y, y * w + x, 0);
+			Ray r = cameraRay(cx, cy, w, h, x, y, 0, 0, sampler);
+			double t;
+			int id = 0;
+			if (!intersect(r, t, id) || primitiveBRDF(id).isSpecular()) continue;
+			ShadingPoint sp;
+			sp.id = id;
+			sp.x = r.o + r.d*t;
+			sp.o = r.d * -1;
+			sp.n = primitiveNormal(id, sp.x);
+			if (sp.n.dot(sp.o) < 0) sp.n = sp.n * -1;
+			points.push_back(sp);
+		}
+
+	RenderSettings saved = settings;
+	printf("%-8s %14s %14s %18s\n", "strategy", "variance", "ns/sample", "equal-time var");
+	double baseline = 0;
+	for (int strategy = LIGHT_AREA; strategy <= LIGHT_CONE; ++strategy) {
+		settings.lightSampling = strategy;
+		double var = 0, t0 = omp_get_wtime();
+		for (size_t k = 0; k < points.size(); ++k) {
+			const ShadingPoint &sp = points[k];
+			double sum = 0, sum2 = 0;
+			for (int s = 0; s < nsamples; ++s) {
+				sampler.startSample(0, 0, int(k), s);
+				Ray out(sp.x, sp.o);
+				double l = luminance(directRadiance(sp.id, primitiveBRDF(sp.id), out, Frame(sp.n), sampler));
+				sum += l; sum2 += l * l;
+			}
+			double mean = sum / nsamples;
+			var += sum2 / nsamples - mean * mean;
+		}
+		double ns = (omp_get_wtime() - t0) * 1e9 / (double(points.size()) * nsamples);
+		var /= points.size();
+		double eq = var * ns;
+		if (strategy == LIGHT_AREA) baseline = eq;
+		printf("%-8s %14.4f %14.1f %18.4f   (%.2fx vs area)\n", lightSamplingName(strategy), var, ns, eq, baseline / eq);
+	}
+	settings = saved;
+}
+
+// Render time of a small image at 1, 2, 4, ... threads up to the core count
+void benchScaling() {
+	const int w = 240, h = 180, samps = 2;
+	const int maxThreads = omp_get_num_procs();
+	std::vector<Vec> c;
+
+	printf("%-10s %8s %10s %12s %10s %11s\n", "renderer", "threads", "seconds", "Mpaths/s", "speedup", "efficiency");
+	for (int wavefront = 0; wavefront <= 1; ++wavefront) {
+		RenderSettings saved = settings;
+		settings.wavefront = wavefront != 0;
+		double base = 0;
+		for (int n = 1; ; n = std::min(2 * n, maxThreads)) {
+			omp_set_num_threads(n);
+			double t0 = omp_get_wtime();
+			renderImage(w, h, samps, c);
+			double t = omp_get_wtime() - t0;
+			if (n == 1) base = t;
+			printf("%-10s %8d %10.3f %12.3f %9.2fx %10.0f%%\n", wavefront ? "wavefront" : "megakernel",
+				n, t, w * h * samps * 4 * 1e-6 / t, base / t, 100. * base / (t * n));
+			if (n == maxThreads) break;
+		}
+		settings = saved;
+	}
+	omp_set_num_threads(maxThreads);
+}
+
+// Samples and RMSE against the reference for uniform and adaptive sampling
+void benchAdaptive() {
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	RenderSettings saved = settings;
+	printf("%-10s %10s %10s %10s\n", "mode", "avg spp", "seconds", "rmse");
+	for (int spp = 16; spp <= 128; spp *= 2) {
+		double t0 = omp_get_wtime();
+		renderImage(w, h, spp / 4, c);
+		printf("%-10s %10d %10.2f %10.3f\n", "uniform", spp, omp_get_wtime() - t0, displayRMSE(c, ref));
+		fflush(stdout);
+	}
+	const double thresholds[] = { 0.2, 0.1, 0.05 };
+	for (int k = 0; k < 3; ++k) {
+		settings.adaptiveError = thresholds[k];
+		double t0 = omp_get_wtime();
+		double spp = renderProgressive(w, h, 128, 0, c);
+		char mode[32];
+		snprintf(mode, sizeof(mode), "adapt %.2f", thresholds[k]);
+		printf("%-10s %10.1f %10.2f %10.3f\n", mode, spp, omp_get_wtime() - t0, displayRMSE(c, ref));
+		fflush(stdout);
+	}
+	settings = saved;
+}
+
+// Error of raw and denoised renders at low spp against the reference
+void benchDenoise() {
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	DenoiseSettings saved = denoise;
+	printf("%-10s %10s %10s %10s\n", "mode", "spp", "seconds", "rmse");
+	for (int k = 0; k < 2; ++k) {
+		denoise.enabled = k == 1;
+		for (int spp = 4; spp <= 64; spp *= 2) {
+			double t0 = omp_get_wtime();
+			renderImage(w, h, spp / 4, c);
+			printf("%-10s %10d %10.2f %10.3f\n", k ? "denoised" : "raw", spp, omp_get_wtime() - t0,
+				displayRMSE(c, ref));
+			fflush(stdout);
+		}
+	}
+	denoise = saved;
+}
+
+// Cost and error of spectral against RGB renders, against the reference
+void benchSpectral() {
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	RenderSettings saved = settings;
+	printf("%-10s %6s %10s %10s %10s\n", "mode", "spp", "seconds", "vs rgb", "rmse");
+	for (int spp = 16; spp <= 64; spp *= 4) {
+		double rgb = 0;
+		for (int spectral = 0; spectral <= 1; ++spectral) {
+			settings.spectral = spectral != 0;
+			double t0 = omp_get_wtime();
+			renderImage(w, h, spp / 4, c);
+			double t = omp_get_wtime() - t0;
+			if (!spectral) rgb = t;
+			printf("%-10s %6d %10.2f %9.2fx %10.3f\n", spectral ? "spectral" : "rgb", spp, t, t / rgb,
+				displayRMSE(c, ref));
+			fflush(stdout);
+		}
+	}
+	settings = saved;
+}
+
+// Startup time of a large scene from text (parse and BVH build) and from
+// its binary form
+void benchScene() {
+	const char *textPath = "bench_scene.tmp", *binPath = "bench_scene_bin.tmp";
+	printf("%10s %12s %12s %12s\n", "spheres", "text s", "binary s", "speedup");
+	for (int n = 1000; n <= 1000000; n *= 10) {
+		std::mt19937 gen(5);
+		std::vector<Sphere> soup = randomSpheres(n, gen);
+		FILE *f = fopen(textPath, "w");
+		if (!f) return;
+		fprintf(f, "camera 50 52 295.6  0 -0.042612 -1  0.5135\nmaterial m diffuse .75 .75 .75\n");
+		for (int k = 0; k < n; ++k)
+			fprintf(f, "sphere %.17g %.17g %.17g %.17g m%s\n", soup[k].rad, soup[k].p.x, soup[k].p.y, soup[k].p.z,
+				k % 100 ? "" : " emit 1 1 1");
+		fclose(f);
+
+		Scene s;
+		BVH accel;
+		double t0 = omp_get_wtime();
+		bool ok = loadScene(textPath, s, accel);
+		double tText = omp_get_wtime() - t0;
+		ok = ok && saveSceneBinary(binPath, s, accel);
+		t0 = omp_get_wtime();
+		ok = ok && loadScene(binPath, s, accel);
+		double tBin = omp_get_wtime() - t0;
+		if (!ok) break;
+		printf("%10d %12.4f %12.4f %11.1fx\n", n, tText, tBin, tText / tBin);
+	}
+	remove(textPath);
+	remove(binPath);
+}
+
+// Startup (map and BVH build) and ray rate of ever finer tessellations of
+// a sphere, against the analytic sphere in the first row
+void benchMesh() {
+	const char *path = "bench_mesh.tmp";
+	const Vec center(50, 40, 80);
+	const double rad = 30;
+	std::mt19937 gen(99);
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<Ray> rays;
+	for (int i = 0; i < 4096; ++i) {
+		Vec o(100 * u(gen), 80 * u(gen), 170 * u(gen) + 200);
+		Vec aim = center + Vec(u(gen) - .5, u(gen) - .5, u(gen) - .5) * (2.5 * rad);
+		rays.push_back(Ray(o, (aim - o).normalize()));
+	}
+
+	Sphere ball(rad, center, Vec(), benchSurf);
+	double analytic = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+		id = 0;
+		return (t = ball.intersect(r)) > 0; });
+	printf("%10s %10s %10s %14s\n", "triangles", "map s", "build s", "Mrays/s");
+	printf("%10s %10s %10s %14.3f\n", "sphere", "-", "-", analytic * 1e-6);
+
+	for (int rings = 16; rings <= 1024; rings *= 4) {
+		const int segments = 2 * rings;
+		std::vector<float> x, y, z;
+		std::vector<uint32_t> indices;
+		for (int i = 0; i <= rings; ++i)
+			for (int j = 0; j < segments; ++j) {
+				double th = PI * i / rings, ph = 2 * PI * j / segments;
+				x.push_back(float(center.x + rad * sin(th) * cos(ph)));
+				y.push_back(float(center.y + rad * cos(th)));
+				z.push_back(float(center.z + rad * sin(th) * sin(ph)));
+			}
+		for (int i = 0; i < rings; ++i)
+			for (int j = 0; j < segments; ++j) {
+				uint32_t a = i * segments + j, b = i * segments + (j + 1) % segments;
+				uint32_t quad[6] = { a, b, b + segments, a, b + segments, a + segments };
+				indices.insert(indices.end(), quad, quad + 6);
+			}
+		Mesh m;
+		m.x = x.data(); m.y = y.data(); m.z = z.data();
+		m.indices = indices.data();
+		m.numVertices = int(x.size());
+		m.numTriangles = int(indices.size() / 3);
+		if (!writeMesh(path, m)) return;
+
+		Scene s;
+		s.materials.push_back(benchSurf);
+		s.meshes.resize(1);
+		double t0 = omp_get_wtime();
+		if (!loadMesh(path, s.meshes[0])) return;
+		double tMap = omp_get_wtime() - t0;
+		linkMeshes(std::vector<int>(1, 0), s);
+		BVH accel;
+		t0 = omp_get_wtime();
+		buildBVH(s, accel);
+		double tBuild = omp_get_wtime() - t0;
+		double rate = raysPerSecond(rays, 0.5, [&](const Ray &r, double &t, int &id) {
+			return accel.intersect(r, t, id); });
+		printf("%10d %10.4f %10.4f %14.3f\n", m.numTriangles, tMap, tBuild, rate * 1e-6);
+		fflush(stdout);
+	}
+	remove(path);
+}
+
+// Speed and RMSE of this build's scalar type; build with and without
+// -DSIMPLEPT_FP32 to compare
+void benchPrecision() {
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	RenderSettings saved = settings;
+	printf("%-8s %-10s %6s %10s %10s\n", "real", "renderer", "spp", "seconds", "rmse");
+	for (int wavefront = 0; wavefront <= 1; ++wavefront) {
+		settings.wavefront = wavefront != 0;
+		for (int spp = 16; spp <= 64; spp *= 4) {
+			double t0 = omp_get_wtime();
+			renderImage(w, h, spp / 4, c);
+			printf("%-8s %-10s %6d %10.2f %10.3f\n", sizeof(Real) == 4 ? "float" : "double",
+				wavefront ? "wavefront" : "megakernel", spp, omp_get_wtime() - t0, displayRMSE(c, ref));
+			fflush(stdout);
+		}
+	}
+	settings = saved;
+}
+
+// Gamma conversion and image writing throughput at 4K
+void benchOutput() {
+	const int w = 3840, h = 2160;
+	std::vector<Vec> c(w * h);
+	std::mt19937 gen(77);
+	std::uniform_real_distribution<double> u(0.0, 1.2);
+	for (size_t i = 0; i < c.size(); ++i) c[i] = Vec(u(gen), u(gen), u(gen));
+
+	double t0 = omp_get_wtime();
+	int sum = 0;
+	for (size_t i = 0; i < c.size(); ++i) sum += gammaPow(c[i].x) + gammaPow(c[i].y) + gammaPow(c[i].z);
+	double tPow = omp_get_wtime() - t0;
+	t0 = omp_get_wtime();
+	for (size_t i = 0; i < c.size(); ++i) sum -= toInt(c[i].x) + toInt(c[i].y) + toInt(c[i].z);
+	double tLut = omp_get_wtime() - t0;
+	benchSink = sum;
+	printf("%-12s %10.1f Mpixels/s\n", "gamma pow", w * h * 1e-6 / tPow);
+	printf("%-12s %10.1f Mpixels/s%s\n", "gamma table", w * h * 1e-6 / tLut, sum ? "  (MISMATCH)" : "");
+
+	const char *tmp = "bench_output.tmp";
+	for (int pfm = 0; pfm <= 1; ++pfm) {
+		t0 = omp_get_wtime();
+		bool ok = writeImage(tmp, pfm != 0, w, h, c);
+		double t = omp_get_wtime() - t0;
+		printf("%-12s %10.1f Mpixels/s%s\n", pfm ? "write pfm" : "write ppm", w * h * 1e-6 / t, ok ? "" : "  (FAILED)");
+	}
+	remove(tmp);
+}
+
+// Splits one frame into 1, 2 and 4 parts by tiles and by samples, renders
+// the parts one after another as separate processes would, and merges their
+// buffers. Efficiency is the one-part time over parts x the slowest part;
+// the difference to the one-part image should be only float rounding.
+void benchCluster() {
+	const int w = 240, h = 180, samps = 4;
+	const char *paths[] = { "bench_part0.tmp", "bench_part1.tmp", "bench_part2.tmp", "bench_part3.tmp" };
+	const ClusterSettings saved = cluster;
+	std::vector<Vec> single, c, merged;
+
+	printf("%-8s %6s %12s %12s %11s %12s\n", "split", "parts", "slowest s", "total s", "efficiency", "max diff");
+	double base = 0;
+	for (int bySamples = 0; bySamples <= 1; ++bySamples)
+		for (int parts = 1; parts <= 4; parts *= 2) {
+			if (bySamples && parts == 1) continue;
+			double slowest = 0, total = 0;
+			for (int k = 0; k < parts; ++k) {
+				cluster = ClusterSettings();
+				if (bySamples) cluster.firstSample = k * samps / parts;
+				else { cluster.part = k; cluster.parts = parts; }
+				double t0 = omp_get_wtime();
+				renderImage(w, h, bySamples ? samps / parts : samps, c, 0, paths[k]);
+				double t = omp_get_wtime() - t0;
+				slowest = std::max(slowest, t);
+				total += t;
+			}
+			int mw, mh;
+			if (!mergePartials(parts, paths, mw, mh, merged)) break;
+			if (parts == 1) { base = slowest; single = merged; }
+			double diff = 0;
+			for (size_t i = 0; i < merged.size(); ++i) {
+				Vec d = merged[i] - single[i];
+				diff = std::max<double>(diff, std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))));
+			}
+			printf("%-8s %6d %12.3f %12.3f %10.0f%% %12.2e\n", bySamples ? "samples" : "tiles", parts, slowest, total,
+				100. * base / (parts * slowest), diff);
+			fflush(stdout);
+		}
+	for (int k = 0; k < 4; ++k) remove(paths[k]);
+	cluster = saved;
+}
+
+// Renders one frame with the megakernel and with the offload kernel (on the
+// default device, or the host without one). Both draw the same samples, so
+// the images should differ only by device floating point.
+void benchOffload() {
+	const int w = 240, h = 180, samps = 4;
+	const int device = omp_get_num_devices() > 0 ? omp_get_default_device() : omp_get_initial_device();
+	const RenderSettings saved = settings;
+	Vec cx, cy;
+	cam.axes(w, h, cx, cy);
+
+	printf("offload device %d%s\n", device, device == omp_get_initial_device() ? " (the host)" : "");
+	printf("%-6s %10s %10s %12s\n", "case", "host s", "device s", "max diff");
+	for (int mis = 0; mis <= 1; ++mis) {
+		settings = RenderSettings();
+		settings.seed = 1;
+		settings.mis = mis != 0;
+		Film host(w, h), offload(w, h);
+		double t0 = omp_get_wtime();
+		renderMegakernel(host, samps, 0, 0, 0, cx, cy);
+		double t1 = omp_get_wtime();
+		renderOffload(device, offload, samps, 0, 0, 0, cx, cy);
+		double t2 = omp_get_wtime(), diff = 0;
+		for (int i = 0; i < w * h; ++i) {
+			Vec d = host.pixel(i) - offload.pixel(i);
+			diff = std::max<double>(diff, std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))));
+		}
+		printf("%-6s %10.3f %10.3f %12.2e\n", mis ? "mis" : "area", t1 - t0, t2 - t1, diff);
+		fflush(stdout);
+	}
+	settings = saved;
+}
+
+// Error of the last frame of a camera pan against a 128 spp render of it,
+// rendering every frame from scratch or reprojecting the previous one
+void benchAnimation() {
+	const int w = 160, h = 120;
+	const AnimationSettings saved = animation;
+	std::vector<Vec> ref, c;
+	animation.frames = 6;
+	animation.pan = Vec(2, 0, 0);
+	animation.reproject = false;
+	renderAnimation(w, h, 32, 0, ref);
+	for (size_t i = 0; i < ref.size(); ++i) ref[i] = Vec(toInt(ref[i].x), toInt(ref[i].y), toInt(ref[i].z));
+
+	printf("%-10s %6s %10s %12s %10s\n", "mode", "spp", "new spp", "s per frame", "rmse");
+	for (int spp = 16; spp <= 32; spp *= 2)
+		for (int reproject = 0; reproject <= 1; ++reproject) {
+			animation.reproject = reproject != 0;
+			double t0 = omp_get_wtime();
+			double taken = renderAnimation(w, h, spp / 4, 0, c);
+			printf("%-10s %6d %10.1f %12.3f %10.3f\n", reproject ? "reproject" : "fresh", spp, taken,
+				(omp_get_wtime() - t0) / animation.frames, displayRMSE(c, ref));
+			fflush(stdout);
+		}
+	animation = saved;
+}
+
+// Render time with threads left to the OS, bound close and spread, and
+// spread with the BVH replicated per node, over the 100k-sphere soup. On a
+// single node the rows should match; on several, spread and replication
+// should beat unbound threads whose film and scene pages sit on one node.
+void benchNuma() {
+	const int w = 240, h = 180, samps = 2, n = 100000;
+	const NumaSettings saved = numa;
+	Scene s;
+	std::mt19937 gen(5);
+	s.materials.push_back(benchSurf);
+	std::vector<Sphere> soup = randomSpheres(n, gen);
+	for (int k = 0; k < n; ++k)
+		s.spheres.push_back(Sphere(soup[k].rad, soup[k].p, k % 100 ? Vec() : Vec(1, 1, 1), s.materials[0]));
+	s.camera = scene.camera;
+	std::swap(scene, s);
+	BVH built;
+	buildBVH(scene, built);
+	std::swap(bvh, built);
+	useScene();
+
+	std::vector<Vec> c;
+	printf("%-10s %-10s %6s %10s %10s\n", "bind", "replicate", "nodes", "seconds", "speedup");
+	const int binds[] = { BIND_NONE, BIND_CLOSE, BIND_SPREAD, BIND_SPREAD };
+	double base = 0;
+	for (int k = 0; k < 4; ++k) {
+		numa.bind = binds[k];
+		numa.replicate = k == 3;
+		double t0 = omp_get_wtime();
+		renderImage(w, h, samps, c);
+		double t = omp_get_wtime() - t0;
+		if (k == 0) base = t;
+		printf("%-10s %-10s %6d %10.3f %9.2fx\n", k == 0 ? "none" : binds[k] == BIND_CLOSE ? "close" : "spread",
+			numa.replicate ? "yes" : "no", numaState.nodes, t, base / t);
+		fflush(stdout);
+	}
+	numa = saved;
+	replicateScene();   // back to the shared BVH
+	std::swap(scene, s);
+	std::swap(bvh, built);
+	useScene();
+}
+
+// Frames of a small camera pan over a 100k-sphere scene, each from a fresh
+// load as a process per frame would do, then from one Renderer; the
+// Renderer's frame of the built-in box must match renderImage()'s
+void benchRenderer() {
+	const int w = 120, h = 90, spp = 4, frames = 4, n = 100000;
+	const char *path = "bench_renderer.tmp";
+	std::mt19937 gen(5);
+	std::vector<Sphere> soup = randomSpheres(n, gen);
+	FILE *f = fopen(path, "w");
+	if (!f) return;
+	fprintf(f, "camera 50 52 295.6  0 -0.042612 -1  0.5135\nmaterial m diffuse .75 .75 .75\n");
+	for (int k = 0; k < n; ++k)
+		fprintf(f, "sphere %.17g %.17g %.17g %.17g m%s\n", soup[k].rad, soup[k].p.x, soup[k].p.y, soup[k].p.z,
+			k % 100 ? "" : " emit 1 1 1");
+	fclose(f);
+
+	Renderer renderer(w, h);
+	std::vector<Vec> c, frame(w * h);
+	printf("%-10s %12s %12s\n", "mode", "first s", "per frame s");
+	for (int persistent = 0; persistent <= 1; ++persistent) {
+		double first = 0, t0 = omp_get_wtime();
+		Camera base;
+		for (int k = 0; k < frames; ++k) {
+			if (!persistent || k == 0) {
+				if (!renderer.load(path)) break;
+				base = cam;   // the scene's camera
+			}
+			Camera camera = base;
+			camera.o.x += 2 * k;
+			renderer.render(camera, spp, &frame[0]);
+			if (k == 0) first = omp_get_wtime() - t0;
+		}
+		printf("%-10s %12.3f %12.3f\n", persistent ? "renderer" : "fresh", first,
+			(omp_get_wtime() - t0 - first) / (frames - 1));
+		fflush(stdout);
+	}
+	remove(path);
+
+	renderer.load();
+	renderer.render(cam, spp, &frame[0]);
+	renderImage(w, h, spp / 4, c);
+	double diff = 0;
+	for (int i = 0; i < w * h; ++i) {
+		Vec d = frame[i] - c[i];
+		diff = std::max<double>(diff, std::max(std::abs(d.x), std::max(std::abs(d.y), std::abs(d.z))));
+	}
+	printf("max diff to renderImage: %.2e\n", diff);
+}
+
+// Nanoseconds per call of fn(k), k counting calls, over about `seconds`
+template <class F>
+double nsPerCall(double seconds, F fn) {
+	long long count = 0;
+	double t0 = omp_get_wtime(), t1, sum = 0;
+	do {
+		for (int k = 0; k < 1024; ++k) sum += fn(int(count + k));
+		count += 1024;
+		benchSink = sum;
+	} while ((t1 = omp_get_wtime()) - t0 < seconds);
+	return (t1 - t0) * 1e9 / count;
+}
+
+// Cost of the estimator's building blocks in isolation, on the loaded scene
+void benchMicro() {
+	std::mt19937 gen(2024);
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<Ray> rays;
+	std::vector<Frame> frames;
+	for (int i = 0; i < 1024; ++i) {
+		Vec d = Vec(u(gen) - .5, u(gen) - .5, u(gen) - .5).normalize();
+		rays.push_back(Ray(Vec(100 * u(gen), 80 * u(gen), 170 * u(gen)), d));
+		frames.push_back(Frame(d));
+	}
+	if (!numSpheres || !lights.size()) return;
+	const Sphere &light = spheres[lights.ids[0]];
+	const BRDF diffuse(BRDF_DIFFUSE, Vec(.75, .75, .75));
+	Sampler sampler(SAMPLER_INDEPENDENT, 1);
+	sampler.startSample(0, 0, 0, 0);
+
+	const int w = 480, h = 360;
+	Vec cx, cy;
+	cam.axes(w, h, cx, cy);
+
+	printf("%-22s %12s\n", "function", "ns/call");
+	printf("%-22s %12.2f\n", "Sphere::intersect", nsPerCall(0.5, [&](int k) {
+		return spheres[k % numSpheres].intersect(rays[k & 1023]); }));
+	printf("%-22s %12.2f\n", "uniformRandomPSA", nsPerCall(0.5, [&](int k) {
+		Vec i;
+		Real pdf;
+		uniformRandomPSA(frames[k & 1023], rays[k & 1023].d, i, pdf, sampler);
+		return i.x; }));
+	printf("%-22s %12.2f\n", "luminaireSample", nsPerCall(0.5, [&](int) {
+		Vec y, n;
+		Real pdf;
+		luminaireSample(light, y, n, pdf, sampler);
+		return y.x; }));
+	printf("%-22s %12.2f\n", "luminaireSampleCone", nsPerCall(0.5, [&](int k) {
+		Vec y, n;
+		Real pdf;
+		luminaireSampleCone(light, rays[k & 1023].o, y, n, pdf, sampler);
+		return y.x; }));
+	printf("%-22s %12.2f\n", "BRDF::eval (diffuse)", nsPerCall(0.5, [&](int k) {
+		return diffuse.eval(frames[k & 1023], rays[k & 1023].d, rays[(k + 1) & 1023].d).x; }));
+	printf("%-22s %12.2f\n", "receivedRadiance", nsPerCall(1.0, [&](int k) {
+		const int x = k % w, y = (k / w) % h;
+		sampler.startSample(x, y, y * w + x, k);
+		return receivedRadiance(cameraRay(cx, cy, w, h, x, y, k & 1, (k >> 1) & 1, sampler), 1, true, sampler).x; }));
+}
+
+// Fixed-seed renders of the built-in scene under the common settings, with
+// time, ray rate and error against the reference image: the numbers to
+// compare before and after a change
+void benchRegression() {
+	struct Case {
+		const char *name;
+		bool wavefront, mis;
+		int lightSampling, sampler;
+		double cacheCell;
+	};
+	const Case cases[] = {
+		{ "area", false, false, LIGHT_AREA, SAMPLER_INDEPENDENT, 0 },
+		{ "area+mis", false, true, LIGHT_AREA, SAMPLER_INDEPENDENT, 0 },
+		{ "cone+mis", false, true, LIGHT_CONE, SAMPLER_INDEPENDENT, 0 },
+		{ "sobol", false, false, LIGHT_AREA, SAMPLER_SOBOL, 0 },
+		{ "wavefront", true, false, LIGHT_AREA, SAMPLER_INDEPENDENT, 0 },
+		{ "cache", false, false, LIGHT_AREA, SAMPLER_INDEPENDENT, 2 },
+	};
+	const int spp = 16;
+
+	int w, h;
+	std::vector<Vec> ref, c;
+	if (!readPPM(referenceImage, w, h, ref)) {
+		fprintf(stderr, "Cannot read reference image %s\n", referenceImage);
+		return;
+	}
+
+	RenderSettings saved = settings;
+	printf("%-10s %6s %10s %10s %10s %10s\n", "case", "spp", "seconds", "Mrays/s", "rmse", "relmse");
+	for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k) {
+		settings = RenderSettings();
+		settings.seed = 1;
+		settings.wavefront = cases[k].wavefront;
+		settings.mis = cases[k].mis;
+		settings.lightSampling = cases[k].lightSampling;
+		settings.sampler = cases[k].sampler;
+		settings.cacheCell = cases[k].cacheCell;
+
+		resetStats();
+		double t0 = omp_get_wtime();
+		renderImage(w, h, spp / 4, c);
+		double t = omp_get_wtime() - t0;
+		RenderStats stats = totalStats();   // all zero with SIMPLEPT_NO_STATS
+		printf("%-10s %6d %10.2f %10.3f %10.3f %10.5f\n", cases[k].name, spp, t,
+			(stats.closestRays + stats.shadowRays) * 1e-6 / t, displayRMSE(c, ref), relativeMSE(c, ref));
+		fflush(stdout);
+	}
+	settings = saved;
+
+	// Geometrically spaced spheres, whose SAH tree would outgrow the
+	// traversal stack without the build's depth limit
+	const char *deepPath = "bench_deep.tmp";
+	FILE *f = fopen(deepPath, "w");
+	if (!f) return;
+	fprintf(f, "camera 50 52 295.6  0 -0.042612 -1  0.5135\nmaterial m diffuse .75 .75 .75\n");
+	for (int k = 0; k <= 200; ++k)
+		fprintf(f, "sphere %.17g %.17g 0 0 m%s\n", 1e-3 * pow(3.0, k), pow(3.0, k), k % 10 ? "" : " emit 1 1 1");
+	fclose(f);
+	Scene s;
+	BVH built;
+	bool ok = loadScene(deepPath, s, built);
+	remove(deepPath);
+	if (!ok) return;
+	int depth = BVH::depth(built.nodes.data(), int(built.nodes.size()));
+	std::swap(scene, s);
+	std::swap(bvh, built);
+	useScene();
+	double t0 = omp_get_wtime();
+	renderImage(64, 48, 1, c);
+	printf("deep scene: %d spheres, bvh depth %d of %d, %.2f s\n", int(scene.spheres.size()), depth,
+		BVH::stackSize, omp_get_wtime() - t0);
+	std::swap(scene, s);
+	std::swap(bvh, built);
+	useScene();
+}
+
+struct Benchmark {
+	const char *name;
+	void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+	{ "bvh", benchBVH },
+	{ "isect", benchIntersect },
+	{ "sampler", benchSampler },
+	{ "light", benchLightSampling },
+	{ "scaling", benchScaling },
+	{ "adaptive", benchAdaptive },
+	{ "output", benchOutput },
+	{ "precision", benchPrecision },
+	{ "scene", benchScene },
+	{ "mesh", benchMesh },
+	{ "micro", benchMicro },
+	{ "regress", benchRegression },
+	{ "cluster", benchCluster },
+	{ "offload", benchOffload },
+	{ "denoise", benchDenoise },
+	{ "renderer", benchRenderer },
+	{ "animation", benchAnimation },
+	{ "numa", benchNuma },
+	{ "spectral", benchSpectral },
+};
+
+int runBenchmark(const char *name) {
+	bool all = !strcmp(name, "all"), found = all;
+	for (size_t b = 0; b < sizeof(benchmarks) / sizeof(Benchmark); ++b) {
+		if (!all && strcmp(name, benchmarks[b].name)) continue;
+		benchmarks[b].run();
+		found = true;
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown benchmark '%s' (available:", name);
+		for (size_t b = 0; b < sizeof(benchmarks) / sizeof(Benchmark); ++b)
+			fprintf(stderr, " %s", benchmarks[b].name);
+		fprintf(stderr, ", all)\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+* Main function
+*/
+
+void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [spp] [options]\n"
+		"       %s --bench [name]\n"
+		"       %s --convert-mesh in.obj out.mesh\n"
+		"       %s --merge out.ppm|out.pfm buffer...\n"
+		"options:\n"
+		"  --maxdepth N    maximum path depth (default %d)\n"
+		"  --rrdepth N     depth at which Russian roulette starts (default %d)\n"
+		"  --wavefront     trace tiles bounce by bounce with per-material batches\n"
+		"  --device D      cpu, or gpu to offload passes to an OpenMP target device (default cpu)\n"
+		"  --bind B        pin threads to CPUs filling NUMA nodes in turn (close) or round-robin (spread)\n"
+		"  --replicate     copy the BVH to every NUMA node (implies --bind spread)\n"
+		"  --seed N        base random seed (default 0)\n"
+		"  --sampler S     independent, sobol or bluenoise (default independent)\n"
+		"  --light S       light sampling: area or cone (default area)\n"
+		"  --lightselect S choose a light by power or by light bvh (default power)\n"
+		"  --mis           multiple importance sampling of light and BRDF samples\n"
+		"  --spectral      trace 4 hero wavelengths per path instead of RGB\n"
+		"  --cache S       end paths at a radiance cache of S-sized cells after their first diffuse bounce\n"
+		"  --caustics N    trace N photons into a caustic map before rendering\n"
+		"  --caustic-radius R  caustic map gather radius (default %g)\n"
+		"  --tile N        tile edge in pixels for the thread scheduler (default %d)\n"
+		"  --time S        render progressively for at most S seconds\n"
+		"  --noise X       render progressively until the estimated rmse (0-255) is below X\n"
+		"  --adaptive E    render progressively, past %d spp only where the relative error exceeds E\n"
+		"  --output FILE   image to write, binary PPM or (.pfm) linear floats (default image.ppm)\n"
+		"  --stream        write image rows as soon as their tiles finish\n"
+		"  --stats FILE    write ray counts, path lengths and phase times as JSON (- for stdout)\n"
+		"  --partial FILE  also write the accumulation buffer, for --merge\n"
+		"  --denoise       filter the image guided by albedo, normals and per-pixel variance\n"
+		"  --denoise-hook CMD  denoise by running CMD color.pfm albedo.pfm normal.pfm out.pfm\n"
+		"  --frames N      render N frames, moving the camera by --pan each frame, to FILE_0000.ext ...\n"
+		"  --pan X Y Z     camera move per frame (default none)\n"
+		"  --reproject     reuse each frame's samples in the next wherever they still see the same point\n"
+		"  --checkpoint FILE  resume from FILE if it exists, and keep it up to date\n"
+		"  --checkpoint-every S  seconds between checkpoint flushes (default %g)\n"
+		"  --tiles K/N     render only tiles K, K+N, K+2N, ... of the image\n"
+		"  --first-sample S  start every pixel at sample S (a multiple of 4), to split spp across runs\n"
+		"  --scene FILE    render a text or binary scene instead of the built-in Cornell box\n"
+		"  --save-scene F  write the scene (and its BVH) to F in binary form and exit\n"
+		"Progressive runs rewrite the image after every pass; spp, if given, caps them.\n",
+		prog, prog, prog, prog, settings.maxDepth, settings.rrDepth, settings.causticRadius, settings.tileSize,
+		adaptiveBaseSamples * 4,
+		output.checkpointInterval);
+}
+
+// Returns false on a malformed command line
+bool parseArgs(int argc, char *argv[], int &spp) {
+	for (int a = 1; a < argc; ++a) {
+		const char *arg = argv[a];
+		bool hasValue = a + 1 < argc;
+		if (!strcmp(arg, "--maxdepth") && hasValue) settings.maxDepth = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(arg, "--rrdepth") && hasValue) settings.rrDepth = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(arg, "--wavefront")) settings.wavefront = true;
+		else if (!strcmp(arg, "--device") && hasValue) {
+			const char *name = argv[++a];
+			if (!strcmp(name, "cpu")) settings.device = DEVICE_CPU;
+			else if (!strcmp(name, "gpu")) settings.device = DEVICE_GPU;
+			else return false;
+		}
+		else if (!strcmp(arg, "--bind") && hasValue) {
+			const char *name = argv[++a];
+			if (!strcmp(name, "none")) numa.bind = BIND_NONE;
+			else if (!strcmp(name, "close")) numa.bind = BIND_CLOSE;
+			else if (!strcmp(name, "spread")) numa.bind = BIND_SPREAD;
+			else return false;
+		}
+		else if (!strcmp(arg, "--replicate")) numa.replicate = true;
+		else if (!strcmp(arg, "--seed") && hasValue) settings.seed = strtoull(argv[++a], 0, 10);
+		else if (!strcmp(arg, "--sampler") && hasValue) {
+			const char *name = argv[++a];
+			int type = -1;
+			for (int t = SAMPLER_INDEPENDENT; t <= SAMPLER_BLUENOISE; ++t)
+				if (!strcmp(name, samplerName(t))) type = t;
+			if (type < 0) return false;
+			settings.sampler = type;
+		}
+		else if (!strcmp(arg, "--light") && hasValue) {
+			const char *name = argv[++a];
+			if (!strcmp(name, "area")) settings.lightSampling = LIGHT_AREA;
+			else if (!strcmp(name, "cone")) settings.lightSampling = LIGHT_CONE;
+			else return false;
+		}
+		else if (!strcmp(arg, "--mis")) settings.mis = true;
+		else if (!strcmp(arg, "--spectral")) settings.spectral = true;
+		else if (!strcmp(arg, "--cache") && hasValue) settings.cacheCell = std::max(0.0, atof(argv[++a]));
+		else if (!strcmp(arg, "--caustics") && hasValue) settings.causticPhotons = std::max(0, atoi(argv[++a]));
+		else if (!strcmp(arg, "--caustic-radius") && hasValue) settings.causticRadius = std::max(1e-3, atof(argv[++a]));
+		else if (!strcmp(arg, "--tile") && hasValue) settings.tileSize = std::max(1, atoi(argv[++a]));
+		else if (!strcmp(arg, "--time") && hasValue) settings.timeBudget = atof(argv[++a]);
+		else if (!strcmp(arg, "--noise") && hasValue) settings.noiseTarget = atof(argv[++a]);
+		else if (!strcmp(arg, "--adaptive") && hasValue) settings.adaptiveError = atof(argv[++a]);
+		else if (!strcmp(arg, "--output") && hasValue) output.path = argv[++a];
+		else if (!strcmp(arg, "--stream")) output.stream = true;
+		else if (!strcmp(arg, "--stats") && hasValue) output.statsPath = argv[++a];
+		else if (!strcmp(arg, "--partial") && hasValue) output.partialPath = argv[++a];
+		else if (!strcmp(arg, "--denoise")) denoise.enabled = true;
+		else if (!strcmp(arg, "--denoise-hook") && hasValue) denoise.hook = argv[++a];
+		else if (!strcmp(arg, "--frames") && hasValue) animation.frames = std::max(0, atoi(argv[++a]));
+		else if (!strcmp(arg, "--pan") && a + 3 < argc) {
+			animation.pan = Vec(atof(argv[a + 1]), atof(argv[a + 2]), atof(argv[a + 3]));
+			a += 3;
+		}
+		else if (!strcmp(arg, "--reproject")) animation.reproject = true;
+		else if (!strcmp(arg, "--checkpoint") && hasValue) output.checkpointPath = argv[++a];
+		else if (!strcmp(arg, "--checkpoint-every") && hasValue) output.checkpointInterval = atof(argv[++a]);
+		else if (!strcmp(arg, "--tiles") && hasValue) {
+			if (sscanf(argv[++a], "%d/%d", &cluster.part, &cluster.parts) != 2 || cluster.parts < 1 ||
+				cluster.part < 0 || cluster.part >= cluster.parts)
+				return false;
+		}
+		else if (!strcmp(arg, "--first-sample") && hasValue) {
+			int first = atoi(argv[++a]);
+			if (first < 0 || first % 4) return false;
+			cluster.firstSample = first / 4;
+		}
+		else if (!strcmp(arg, "--scene") && hasValue) sceneFiles.path = argv[++a];
+		else if (!strcmp(arg, "--save-scene") && hasValue) sceneFiles.savePath = argv[++a];
+		else if (!strcmp(arg, "--lightselect") && hasValue) {
+			const char *name = argv[++a];
+			if (!strcmp(name, "power")) settings.lightSelect = LIGHTS_POWER;
+			else if (!strcmp(name, "bvh")) settings.lightSelect = LIGHTS_BVH;
+			else return false;
+		}
+		else if (arg[0] != '-') spp = atoi(arg);
+		else return false;
+	}
+	if (numa.replicate && numa.bind == BIND_NONE) numa.bind = BIND_SPREAD;
+	return true;
+}
+
+#ifndef SIMPLEPT_NO_MAIN
+int main(int argc, char *argv[]) {
+	if (!parseScene("cornellBox", cornellBox, scene)) return 1;
+	buildBVH(scene, bvh);
+	useScene();
+
+	if (argc >= 2 && !strcmp(argv[1], "--bench"))
+		return runBenchmark(argc > 2 ? argv[2] : "all");
+	if (argc == 4 && !strcmp(argv[1], "--convert-mesh"))
+		return convertMesh(argv[2], argv[3]) ? 0 : 1;
+	if (argc >= 4 && !strcmp(argv[1], "--merge")) {
+		int w, h;
+		std::vector<Vec> c;
+		if (!mergePartials(argc - 3, argv + 3, w, h, c)) return 1;
+		if (!writeImage(argv[2], isPFM(argv[2]), w, h, c)) {
+			fprintf(stderr, "Cannot write %s\n", argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+
+	int spp = 0;
+	if (!parseArgs(argc, argv, spp)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (output.stream && cluster.parts > 1) {
+		fprintf(stderr, "--stream cannot be used with --tiles\n");
+		return 1;
+	}
+	if (settings.spectral && (settings.wavefront || settings.device != DEVICE_CPU || settings.cacheCell > 0 ||
+		settings.causticPhotons > 0)) {
+		fprintf(stderr, "--spectral renders on the host megakernel, so not --wavefront, --device gpu, --cache "
+			"or --caustics\n");
+		return 1;
+	}
+	if (animation.frames > 0 && (output.stream || output.partialPath || output.checkpointPath ||
+		cluster.parts > 1 || settings.timeBudget > 0 || settings.noiseTarget > 0 || settings.adaptiveError > 0)) {
+		fprintf(stderr, "--frames renders whole frames, so not --stream, --partial, --checkpoint, --tiles "
+			"or progressively\n");
+		return 1;
+	}
+	if ((denoise.enabled || denoise.hook) && (output.stream || cluster.parts > 1)) {
+		fprintf(stderr, "Denoising needs the whole image, so not --stream or --tiles\n");
+		return 1;
+	}
+
+	if (sceneFiles.path) {
+		double t0 = omp_get_wtime();
+		if (!loadScene(sceneFiles.path, scene, bvh)) return 1;
+		useScene();
+		fprintf(stderr, "Loaded %d spheres and %d triangles in %.3f s\n", numSpheres, int(bvh.tris.size()),
+			omp_get_wtime() - t0);
+	}
+	if (sceneFiles.savePath) {
+		if (!saveSceneBinary(sceneFiles.savePath, scene, bvh)) {
+			fprintf(stderr, "Cannot write %s\n", sceneFiles.savePath);
+			return 1;
+		}
+		return 0;
+	}
+	const bool progressive = settings.timeBudget > 0 || settings.noiseTarget > 0 || settings.adaptiveError > 0;
+	if (spp <= 0) spp = progressive ? 4 << 20 : 4;
+
+	int nworkers = omp_get_num_procs();
+	omp_set_num_threads(nworkers);
+
+	int w = 480, h = 360, samps = std::max(1, spp / 4); // # samples
+	std::vector<Vec> c;
+
+#ifdef SIMPLEPT_NO_STATS
+	if (output.statsPath) {
+		fprintf(stderr, "--stats: built with SIMPLEPT_NO_STATS\n");
+		return 1;
+	}
+#endif
+	double t0 = omp_get_wtime();
+	resetStats();
+	if (animation.frames > 0) {
+		double avg = renderAnimation(w, h, samps, output.path, c);
+		fprintf(stderr, "Rendered %d frames in %.2f s\n", animation.frames, omp_get_wtime() - t0);
+		if (output.statsPath && !writeStats(output.statsPath, w, h, avg)) {
+			fprintf(stderr, "Cannot write %s\n", output.statsPath);
+			return 1;
+		}
+		return avg < 0 ? 1 : 0;
+	}
+	if (progressive) {
+		double avg = renderProgressive(w, h, samps, output.path, c, output.partialPath, output.checkpointPath);
+		if (avg < 0) return 1;
+		fprintf(stderr, "Rendered in %.2f s\n", omp_get_wtime() - t0);
+		if (output.statsPath && !writeStats(output.statsPath, w, h, avg)) {
+			fprintf(stderr, "Cannot write %s\n", output.statsPath);
+			return 1;
+		}
+		return 0;
+	}
+	bool ok = renderImage(w, h, samps, c, output.stream ? output.path : 0, output.partialPath,
+		output.checkpointPath);
+	if (c.empty()) return 1;
+	fprintf(stderr, "Rendered in %.2f s\n", omp_get_wtime() - t0);
+	if (output.statsPath && !writeStats(output.statsPath, w, h, samps * 4)) {
+		fprintf(stderr, "Cannot write %s\n", output.statsPath);
+		return 1;
+	}
+
+	if (!output.stream && !writeImage(output.path, isPFM(output.path), w, h, c)) {
+		fprintf(stderr, "Cannot write %s\n", output.path);
+		return 1;
+	}
+	if (!ok) return 1;
+
+	return 0;
+}
+#endif